@@ -0,0 +1,325 @@
+#define _DEFAULT_SOURCE
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "builtins.c"
+
+/*
+ * Batch mode, evaluates requests against one warm global environment.
+ * A request is a line of source, or a line "#N" followed by N bytes of
+ * source, evaluated as if typed into the repl. Each request gets one
+ * response in the same framing, holding its value or error. Output
+ * printed by a framed request is part of its response, for a line it
+ * precedes the value.
+ * Responses are buffered and written once every request read so far is
+ * answered, so pipelined requests share writes.
+ *
+ * With workers, the environment is set up once and forked workers accept
+ * connections on the same socket, sharing its pages copy-on-write. A
+ * worker that has served its requests or grown too much closes its
+ * connection after the response and exits, and a fresh copy of the
+ * environment takes its place.
+ */
+
+typedef struct batch_options {
+    char *socket;
+    int workers;
+
+    /* Worker limits, 0 for none */
+    long max_requests;
+    long max_growth_kb;
+} batch_options;
+
+/* Limits of a worker and what it has used of them */
+typedef struct batch_budget {
+    batch_options *o;
+    long served;
+    long rss_kb;
+} batch_budget;
+
+/* Resident size in kilobytes, the peak where the current one is unknown */
+long batch_rss_kb(void) {
+    long pages;
+    FILE *f = fopen("/proc/self/statm", "r");
+    int known = f && fscanf(f, "%*s %ld", &pages) == 1;
+    if (f) { fclose(f); }
+    if (known) { return pages * (sysconf(_SC_PAGESIZE) / 1024); }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/* Count a request, 1 once the worker should stop after its response */
+int batch_spend(batch_budget *b) {
+    if (b == NULL) { return 0; }
+    b->served++;
+    if (b->o->max_requests && b->served >= b->o->max_requests) { return 1; }
+    return b->o->max_growth_kb && batch_rss_kb() - b->rss_kb >= b->o->max_growth_kb;
+}
+
+/* Length of a "#N" header line, 0 if the line is not one */
+size_t batch_header(const char *line, size_t len, size_t *size) {
+    if (len < 2 || line[0] != '#') { return 0; }
+    size_t n = 0;
+    for (size_t i = 1; i < len; i++) {
+        if (line[i] < '0' || line[i] > '9') { return 0; }
+        n = n * 10 + (size_t) (line[i] - '0');
+    }
+    *size = n;
+    return len;
+}
+
+/* Evaluate one request's source as the repl would and print its value */
+void batch_eval(lenv *e, char *source) {
+    ast *tree = parse(source);
+    lval *x;
+    if (tree->type != AST_ERROR) {
+        x = lval_eval(e, lval_read(tree));
+    } else {
+        x = lval_err(NULL, "%s", tree->val);
+    }
+    free_ast(tree);
+    lsched_drain(lenv_state(e)->sched);
+
+    /* Errors stay on one line, without their context */
+    if (x->type == LVAL_ERR) {
+        lout_printf("Error: %s", lval_err_msg(x));
+    } else {
+        lval_print(x);
+    }
+    lval_del(x);
+}
+
+/* Answer the request at the start of data, returns the bytes used or 0 if incomplete */
+size_t batch_request(lenv *e, char *data, size_t len, lbuf *out) {
+    if (len == 0) { return 0; }
+    char *nl = memchr(data, '\n', len);
+    if (nl == NULL) { return 0; }
+    size_t line = (size_t) (nl - data);
+    size_t end = line > 0 && data[line - 1] == '\r' ? line - 1 : line;
+
+    size_t size;
+    if (batch_header(data, end, &size)) {
+        if (len - line - 1 < size) { return 0; }
+        char *source = str_dup_n(nl + 1, size);
+        lbuf response = {0};
+        lval_out = &response;
+        batch_eval(e, source);
+        lval_out = out;
+
+        lout_printf("#%lu\n", (unsigned long) response.len);
+        lbuf_write(out, response.data, response.len);
+        lout_putc('\n');
+        free(response.data);
+        free(source);
+        return line + 1 + size;
+    }
+
+    /* Blank lines are skipped, they may follow a framed request */
+    if (end > 0) {
+        char *source = str_dup_n(data, end);
+        lval_out = out;
+        batch_eval(e, source);
+        lout_putc('\n');
+        free(source);
+    }
+    return line + 1;
+}
+
+/* Write out everything buffered, 0 if the other end has gone */
+int batch_flush(int fd, lbuf *out) {
+    size_t done = 0;
+    while (done < out->len) {
+        ssize_t n = write(fd, out->data + done, out->len - done);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return 0; }
+        done += (size_t) n;
+    }
+    out->len = 0;
+    return 1;
+}
+
+/* Serve requests read from in until it ends, returns 1 if the budget ran out first */
+int batch_serve(lenv *e, int in, int out, batch_budget *b) {
+    lbuf input = {0};
+    lbuf output = {0};
+    size_t pos = 0;
+    int eof = 0;
+    int spent = 0;
+
+    /* Output of the files loaded before goes first */
+    fflush(stdout);
+
+    while (1) {
+        size_t used;
+        while (!spent && (used = batch_request(e, input.data + pos, input.len - pos, &output)) > 0) {
+            pos += used;
+            spent = batch_spend(b);
+        }
+        lval_out = NULL;
+        if (!batch_flush(out, &output) || eof || spent) { break; }
+
+        /* Keep the incomplete request and read more after it */
+        if (pos) {
+            memmove(input.data, input.data + pos, input.len - pos);
+            input.len -= pos;
+            pos = 0;
+        }
+        lbuf_reserve(&input, 65536);
+        ssize_t n = read(in, input.data + input.len, input.size - input.len);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) {
+            /* A last line may end without a newline */
+            eof = 1;
+            if (input.len) { lbuf_write(&input, "\n", 1); }
+            continue;
+        }
+        input.len += (size_t) n;
+    }
+
+    free(input.data);
+    free(output.data);
+    return spent;
+}
+
+/* Parse the options after --batch, returns the index of the last one or -1 */
+int batch_options_parse(batch_options *o, int argc, char **argv) {
+    memset(o, 0, sizeof(batch_options));
+    int i = 1;
+    while (i + 1 < argc && strncmp(argv[i + 1], "--", 2) == 0) {
+        char *name = argv[i + 1];
+        char *value = i + 2 < argc ? argv[i + 2] : NULL;
+        if (value == NULL) { return -1; }
+
+        if (strcmp(name, "--socket") == 0) {
+            o->socket = value;
+        } else if (strcmp(name, "--workers") == 0) {
+            o->workers = atoi(value);
+        } else if (strcmp(name, "--max-requests") == 0) {
+            o->max_requests = atol(value);
+        } else if (strcmp(name, "--max-growth") == 0) {
+            o->max_growth_kb = atol(value) * 1024;
+        } else {
+            return -1;
+        }
+        i += 2;
+    }
+    if (o->workers && !o->socket) { return -1; }
+    return i;
+}
+
+/* Listening Unix domain socket at path, -1 on failure */
+int batch_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return fd;
+}
+
+/* Serve one connection at a time until a limit is reached */
+void batch_accept(lenv *e, int fd, batch_options *o) {
+    batch_budget b = {o, 0, batch_rss_kb()};
+    while (1) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) { continue; }
+            break;
+        }
+        int spent = batch_serve(e, client, client, &b);
+        close(client);
+        if (spent) { break; }
+    }
+}
+
+/* Workers of the pre-forked server, stopped along with it */
+pid_t *batch_workers = NULL;
+int batch_worker_count = 0;
+volatile sig_atomic_t batch_stopping = 0;
+
+void batch_stop(int sig) {
+    batch_stopping = 1;
+    for (int i = 0; i < batch_worker_count; i++) {
+        if (batch_workers[i] > 0) { kill(batch_workers[i], SIGTERM); }
+    }
+}
+
+/* Fork a worker serving fd from its copy of the environment */
+pid_t batch_fork(lenv *e, int fd, batch_options *o) {
+    /* Output of the loaded files must not be written again by each worker */
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        /* Told to stop before the handlers were reset */
+        if (batch_stopping) { _exit(0); }
+        batch_accept(e, fd, o);
+        _exit(0);
+    }
+    if (pid < 0) { fprintf(stderr, "Could not fork: %s\n", strerror(errno)); }
+    return pid;
+}
+
+/* Keep o->workers workers running, replacing those that exit, until stopped */
+int batch_prefork(lenv *e, int fd, batch_options *o) {
+    batch_workers = calloc((size_t) o->workers, sizeof(pid_t));
+    batch_worker_count = o->workers;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = batch_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for (int i = 0; i < o->workers; i++) { batch_workers[i] = batch_fork(e, fd, o); }
+
+    /* Runs until every worker is gone, which only happens once stopping */
+    while (1) {
+        pid_t pid = waitpid(-1, NULL, 0);
+        if (pid < 0) {
+            if (errno == EINTR) { continue; }
+            break;
+        }
+        for (int i = 0; i < o->workers; i++) {
+            if (batch_workers[i] != pid) { continue; }
+            batch_workers[i] = batch_stopping ? 0 : batch_fork(e, fd, o);
+            /* The stop may have come while forking */
+            if (batch_stopping && batch_workers[i] > 0) { kill(batch_workers[i], SIGTERM); }
+        }
+    }
+
+    free(batch_workers);
+    batch_workers = NULL;
+    batch_worker_count = 0;
+    close(fd);
+    return 0;
+}
+
+/* Serve connections on o->socket, in this process or in forked workers */
+int batch_listen(lenv *e, batch_options *o) {
+    int fd = batch_socket(o->socket);
+    if (fd < 0) { return 1; }
+
+    /* A client going away only ends its own connection */
+    signal(SIGPIPE, SIG_IGN);
+    if (o->workers > 0) { return batch_prefork(e, fd, o); }
+
+    batch_accept(e, fd, o);
+    close(fd);
+    return 0;
+}
@@ -1,32 +1,33 @@
 #include <stdlib.h>
-#include "lval.c"
+#include <limits.h>
+#include "io.c"
 
 char* STD_LIB = "./library/standard_library.lisp";
 
 #define LASSERT(args, cond, fmt, ...) \
   if (!(cond)) { lval* err = lval_err(args->context, fmt, ##__VA_ARGS__); lval_del(args); return err; }
 
-#define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, (args)->cell[index]->type == (expect), \
-    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-    func, index, ltype_name((args)->cell[index]->type), ltype_name(expect))
-
-#define LASSERT_NUM(func, args, num) \
-  LASSERT(args, (args)->count == (num), \
-    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
-    func, (args)->count, num)
+#define LASSERT_CODE(args, cond, ...) \
+  if (!(cond)) { lval* err = lval_err_code(args->context, __VA_ARGS__); lval_del(args); return err; }
 
 #define LASSERT_NOT_EMPTY(func, args, index) \
-  LASSERT(args, (args)->cell[index]->count != 0, \
-    "Function '%s' passed {} for argument %i.", func, index);
+  LASSERT_CODE(args, (args)->cell[index]->count != 0, LERR_ARG_EMPTY, \
+    func, index, 0, 0);
+
+/* Globals and interpreter state are frozen while parallel work runs */
+#define LASSERT_SERIAL(func, args) \
+  LASSERT(args, !lval_parallel, "Function '%s' cannot be used inside parallel work.", func)
+
+/* Settings of the whole process cannot change under other interpreters */
+#define LASSERT_ALONE(func, args) \
+  LASSERT_SERIAL(func, args); \
+  LASSERT(args, !lval_shared, "Function '%s' cannot be used while interpreters share the process.", func)
 
 lval *lval_eval(lenv *e, lval *v);
 
 lval *lval_call(lenv *e, lval *f, lval *a);
 
 lval *builtin_head(lenv *e, lval *a) {
-    LASSERT_NUM("head", a, 1);
-    LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
     LASSERT_NOT_EMPTY("head", a, 0);
 
     lval *v = lval_take(a, 0);
@@ -35,8 +36,6 @@ lval *builtin_head(lenv *e, lval *a) {
 }
 
 lval *builtin_tail(lenv *e, lval *a) {
-    LASSERT_NUM("tail", a, 1);
-    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
     LASSERT_NOT_EMPTY("tail", a, 0);
 
     lval *v = lval_take(a, 0);
@@ -50,20 +49,12 @@ lval *builtin_list(lenv *e, lval *a) {
 }
 
 lval *builtin_eval(lenv *e, lval *a) {
-    LASSERT_NUM("eval", a, 1);
-    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
-
     lval *x = lval_take(a, 0);
     x->type = LVAL_SEXPR;
     return lval_eval(e, x);
 }
 
 lval *builtin_join(lenv *e, lval *a) {
-
-    for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE("join", a, i, LVAL_QEXPR);
-    }
-
     lval *x = lval_pop(a, 0);
 
     while (a->count) {
@@ -74,71 +65,56 @@ lval *builtin_join(lenv *e, lval *a) {
     return x;
 }
 
-lval *builtin_op(lenv *e, lval *a, char *op) {
-
-    /* Ensure all arguments are numbers */
-    for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE(op, a, i, LVAL_NUM);
-    }
-
-    /* Pop the first element */
-    lval *x = lval_pop(a, 0);
-
-    /* If no arguments and sub then perform unary negation */
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = -x->num;
-    }
-
-    /* While there are still elements remaining */
-    while (a->count > 0) {
-
-        /* Pop the next element */
-        lval *y = lval_pop(a, 0);
-
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; }
-        if (strcmp(op, "*") == 0) { x->num *= y->num; }
-        if (strcmp(op, "%") == 0) { x->num %= y->num; }
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                x = lval_err(y->context, "Division By Zero!");
-                lval_del(y);
-                break;
-            }
-            x->num /= y->num;
-        }
-
-        lval_del(y);
-    }
-
-    lval_del(a);
+/* Arithmetic folds into the first argument, types are checked by the caller */
+lval *builtin_add(lenv *e, lval **argv, int argc) {
+    lval *x = argv[0];
+    for (int i = 1; i < argc; i++) { x->num += argv[i]->num; }
+    argv[0] = NULL;
     return x;
 }
 
-lval *builtin_add(lenv *e, lval *a) {
-    return builtin_op(e, a, "+");
-}
+lval *builtin_sub(lenv *e, lval **argv, int argc) {
+    lval *x = argv[0];
 
-lval *builtin_sub(lenv *e, lval *a) {
-    return builtin_op(e, a, "-");
+    /* If no other arguments then perform unary negation */
+    if (argc == 1) { x->num = -x->num; }
+    for (int i = 1; i < argc; i++) { x->num -= argv[i]->num; }
+    argv[0] = NULL;
+    return x;
 }
 
-lval *builtin_mul(lenv *e, lval *a) {
-    return builtin_op(e, a, "*");
+lval *builtin_mul(lenv *e, lval **argv, int argc) {
+    lval *x = argv[0];
+    for (int i = 1; i < argc; i++) { x->num *= argv[i]->num; }
+    argv[0] = NULL;
+    return x;
 }
 
-lval *builtin_div(lenv *e, lval *a) {
-    return builtin_op(e, a, "/");
+lval *builtin_div(lenv *e, lval **argv, int argc) {
+    lval *x = argv[0];
+    for (int i = 1; i < argc; i++) {
+        if (argv[i]->num == 0) {
+            return lval_err_code(argv[i]->context, LERR_DIV_ZERO, NULL, 0, 0, 0);
+        }
+        x->num /= argv[i]->num;
+    }
+    argv[0] = NULL;
+    return x;
 }
 
-lval *builtin_mod(lenv *e, lval *a) {
-    return builtin_op(e, a, "%");
+lval *builtin_mod(lenv *e, lval **argv, int argc) {
+    lval *x = argv[0];
+    for (int i = 1; i < argc; i++) {
+        if (argv[i]->num == 0) {
+            return lval_err_code(argv[i]->context, LERR_DIV_ZERO, NULL, 0, 0, 0);
+        }
+        x->num %= argv[i]->num;
+    }
+    argv[0] = NULL;
+    return x;
 }
 
-lval *builtin_var(lenv *e, lval *a, char *func) {
-    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
-
+lval *builtin_var(lenv *e, lval *a, char *func, void (*set)(lenv *, lval *, lval *)) {
     /* First argument is symbol list */
     lval *syms = a->cell[0];
 
@@ -156,15 +132,18 @@ lval *builtin_var(lenv *e, lval *a, char *func) {
             "%i symbols, %i values.",
             func, syms->count, a->count - 1);
 
+    LASSERT(a, !lval_parallel || (set != lenv_def && !lenv_is_global(e)),
+            "Function %s cannot change globals inside parallel work.", func);
+
     /* Assign copies of values to symbols */
     for (int i = 0; i < syms->count; i++) {
-        if (strcmp(func, "def") == 0) {
-            lenv_def(e, syms->cell[i], a->cell[i + 1]);
-        }
-
-        if (strcmp(func, "=") == 0) {
-            lenv_put(e, syms->cell[i], a->cell[i + 1]);
+        /* A lambda takes the name it is first defined under, for profiles */
+        lval *v = a->cell[i + 1];
+        if (set == lenv_def && v->type == LVAL_FUN && v->lambda && !v->name) {
+            v->name = syms->cell[i]->id;
+            v->library = lenv_state(e)->library;
         }
+        set(e, syms->cell[i], v);
     }
 
     lval *empty_res = lval_sexpr(a->context);
@@ -173,11 +152,19 @@ lval *builtin_var(lenv *e, lval *a, char *func) {
 }
 
 lval *builtin_def(lenv *e, lval *a) {
-    return builtin_var(e, a, "def");
+    return builtin_var(e, a, "def", lenv_def);
 }
 
 lval *builtin_put(lenv *e, lval *a) {
-    return builtin_var(e, a, "=");
+    /* Assign around loop scopes, unless to the loop variable itself */
+    for (; e->loop; e = e->parent) {
+        int own = 0;
+        for (int i = 0; i < a->cell[0]->count; i++) {
+            if (a->cell[0]->cell[i]->id == e->syms[0]) { own = 1; }
+        }
+        if (own) { break; }
+    }
+    return builtin_var(e, a, "=", lenv_put);
 }
 
 lval *builtin_exit(lenv *e, lval *a) {
@@ -186,11 +173,6 @@ lval *builtin_exit(lenv *e, lval *a) {
 }
 
 lval *builtin_lambda(lenv *e, lval *a) {
-    /* Check Two arguments, each of which are Q-Expressions */
-    LASSERT_NUM("lambda", a, 2);
-    LASSERT_TYPE("lambda", a, 0, LVAL_QEXPR);
-    LASSERT_TYPE("lambda", a, 1, LVAL_QEXPR);
-
     /* Check first Q-Expression contains only Symbols */
     for (int i = 0; i < a->cell[0]->count; i++) {
         LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
@@ -200,7 +182,7 @@ lval *builtin_lambda(lenv *e, lval *a) {
 
     /* Pop first two arguments and pass them to lval_lambda */
     lval *formals = lval_pop(a, 0);
-    lval *body = lval_pop(a, 0);
+    lval *body = lval_optimize(e, formals, lval_pop(a, 0));
 
     lval *res = lval_lambda(formals, body, a->context);
     lval_del(a);
@@ -208,10 +190,6 @@ lval *builtin_lambda(lenv *e, lval *a) {
 }
 
 lval *builtin_fun(lenv *e, lval *a) {
-    /* Check Two arguments, each of which are Q-Expressions */
-    LASSERT_NUM("fun", a, 2);
-    LASSERT_TYPE("fun", a, 0, LVAL_QEXPR);
-    LASSERT_TYPE("fun", a, 1, LVAL_QEXPR);
     LASSERT_NOT_EMPTY("fun", a, 0);
 
     /* Check first Q-Expression contains only Symbols */
@@ -223,7 +201,7 @@ lval *builtin_fun(lenv *e, lval *a) {
 
     lval *formals = lval_pop(a, 0);
     lval *name = lval_pop(formals, 0);
-    lval *body = lval_pop(a, 0);
+    lval *body = lval_optimize(e, formals, lval_pop(a, 0));
 
     lval *params = lval_add(lval_qexpr(name->context), lval_add(lval_qexpr(name->context), name));
     lval_add(params, lval_lambda(formals, body, a->context));
@@ -233,74 +211,40 @@ lval *builtin_fun(lenv *e, lval *a) {
     return builtin_def(e, params);
 }
 
-lval *builtin_ord(lenv *e, lval *a, char *op) {
-    LASSERT_NUM(op, a, 2);
-    LASSERT_TYPE(op, a, 0, LVAL_NUM);
-    LASSERT_TYPE(op, a, 1, LVAL_NUM);
-
-    int r;
-    if (strcmp(op, ">") == 0) {
-        r = (a->cell[0]->num > a->cell[1]->num);
-    }
-    if (strcmp(op, "<") == 0) {
-        r = (a->cell[0]->num < a->cell[1]->num);
-    }
-    if (strcmp(op, ">=") == 0) {
-        r = (a->cell[0]->num >= a->cell[1]->num);
-    }
-    if (strcmp(op, "<=") == 0) {
-        r = (a->cell[0]->num <= a->cell[1]->num);
-    }
-    lval *num = lval_num(r, a->context);
-    lval_del(a);
-    return num;
-}
-
-lval *builtin_gt(lenv *e, lval *a) {
-    return builtin_ord(e, a, ">");
+/* Truth value, reusing the first argument when it is a number */
+lval *builtin_bool(lval **argv, int r) {
+    lval *x = argv[0];
+    if (x->type != LVAL_NUM) { return lval_num(r, x->context); }
+    x->num = r;
+    argv[0] = NULL;
+    return x;
 }
 
-lval *builtin_lt(lenv *e, lval *a) {
-    return builtin_ord(e, a, "<");
+lval *builtin_gt(lenv *e, lval **argv, int argc) {
+    return builtin_bool(argv, argv[0]->num > argv[1]->num);
 }
 
-lval *builtin_ge(lenv *e, lval *a) {
-    return builtin_ord(e, a, ">=");
+lval *builtin_lt(lenv *e, lval **argv, int argc) {
+    return builtin_bool(argv, argv[0]->num < argv[1]->num);
 }
 
-lval *builtin_le(lenv *e, lval *a) {
-    return builtin_ord(e, a, "<=");
+lval *builtin_ge(lenv *e, lval **argv, int argc) {
+    return builtin_bool(argv, argv[0]->num >= argv[1]->num);
 }
 
-lval *builtin_cmp(lenv *e, lval *a, char *op) {
-    LASSERT_NUM(op, a, 2);
-    int r;
-    if (strcmp(op, "==") == 0) {
-        r = lval_eq(a->cell[0], a->cell[1]);
-    }
-    if (strcmp(op, "!=") == 0) {
-        r = !lval_eq(a->cell[0], a->cell[1]);
-    }
-    lval *num = lval_num(r, a->context);
-    lval_del(a);
-    return num;
+lval *builtin_le(lenv *e, lval **argv, int argc) {
+    return builtin_bool(argv, argv[0]->num <= argv[1]->num);
 }
 
-lval *builtin_eq(lenv *e, lval *a) {
-    return builtin_cmp(e, a, "==");
+lval *builtin_eq(lenv *e, lval **argv, int argc) {
+    return builtin_bool(argv, lval_eq(argv[0], argv[1]));
 }
 
-lval *builtin_ne(lenv *e, lval *a) {
-    return builtin_cmp(e, a, "!=");
+lval *builtin_ne(lenv *e, lval **argv, int argc) {
+    return builtin_bool(argv, !lval_eq(argv[0], argv[1]));
 }
 
 lval *builtin_if(lenv *e, lval *a) {
-    /* Check Two arguments, each of which are Q-Expressions */
-    LASSERT_NUM("if", a, 3);
-    LASSERT_TYPE("if", a, 0, LVAL_NUM);
-    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-    LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
-
     /* Pop first two arguments and pass them to lval_lambda */
     lval *cond = lval_pop(a, 0);
     lval *if_body = lval_pop(a, 0);
@@ -316,314 +260,1897 @@ lval *builtin_if(lenv *e, lval *a) {
     }
 }
 
-lval *builtin_or(lenv *e, lval *a) {
-    LASSERT_NUM("or", a, 2);
-    LASSERT_TYPE("or", a, 0, LVAL_NUM);
-    LASSERT_TYPE("or", a, 1, LVAL_NUM);
-
-    lval *num = lval_num(a->cell[0]->num || a->cell[1]->num, a->context);
+lval *builtin_logic(lenv *e, lval *a, char *op, int stop) {
+    /* Special form, operands are evaluated left to right until one decides */
+    int r = !stop;
+    while (a->count) {
+        lval *x = lval_eval(e, lval_pop(a, 0));
+        if (x->type == LVAL_ERR) {
+            lval_del(a);
+            return x;
+        }
+        if (x->type != LVAL_NUM) {
+            lval *err = lval_err(x->context,
+                                 "Function '%s' passed incorrect type. Got %s, Expected %s.",
+                                 op, ltype_name(x->type), ltype_name(LVAL_NUM));
+            lval_del(x);
+            lval_del(a);
+            return err;
+        }
+        int truth = x->num != 0;
+        lval_del(x);
+        if (truth == stop) {
+            r = stop;
+            break;
+        }
+    }
 
+    lval *num = lval_num(r, a->context);
     lval_del(a);
-
     return num;
 }
 
+lval *builtin_or(lenv *e, lval *a) {
+    return builtin_logic(e, a, "||", 1);
+}
+
 lval *builtin_and(lenv *e, lval *a) {
-    LASSERT_NUM("and", a, 2);
-    LASSERT_TYPE("and", a, 0, LVAL_NUM);
-    LASSERT_TYPE("and", a, 1, LVAL_NUM);
+    return builtin_logic(e, a, "&&", 0);
+}
 
-    lval *num = lval_num(a->cell[0]->num && a->cell[1]->num, a->context);
+lval *builtin_do(lenv *e, lval *a) {
+    /* Special form, evaluate in sequence and keep the last result */
+    lval *x = lval_qexpr(a->context);
+    while (a->count) {
+        lval_del(x);
+        x = lval_eval(e, lval_pop(a, 0));
+        if (x->type == LVAL_ERR) { break; }
+    }
     lval_del(a);
-    return num;
+    return x;
 }
 
-lval *builtin_not(lenv *e, lval *a) {
-    LASSERT_NUM("or", a, 1);
-    LASSERT_TYPE("or", a, 0, LVAL_NUM);
+lval *builtin_let(lenv *e, lval *a) {
+    /* Evaluate the body in a fresh scope on top of the caller's */
+    lenv *scope = lenv_new_local();
+    lenv_set_parent(scope, e);
 
-    lval *num = lval_num(!a->cell[0]->num, a->context);
+    lval *body = lval_take(a, 0);
+    body->type = LVAL_SEXPR;
+    lval *x = lval_eval(scope, body);
 
-    lval_del(a);
+    lenv_del(scope);
+    return x;
+}
 
-    return num;
+/* Evaluate a copy of a Q-Expression as code, leaving the original intact */
+lval *lval_eval_copy(lenv *e, lval *q) {
+    lval *x = lval_copy(q);
+    x->type = LVAL_SEXPR;
+    return lval_eval(e, x);
 }
 
-void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
-    lval *k = lval_sym(name, NULL);
-    lval *v = lval_func(func);
-    lenv_put(e, k, v);
-    lval_del(k);
-    lval_del(v);
+lval *builtin_while(lenv *e, lval *a) {
+    /* Loop in C so iterations use neither stack nor frames */
+    while (1) {
+        lval *cond = lval_eval_copy(e, a->cell[0]);
+        if (cond->type != LVAL_NUM) {
+            if (cond->type == LVAL_ERR) {
+                lval_del(a);
+                return cond;
+            }
+            lval *err = lval_err(cond->context,
+                                 "Function 'while' passed incorrect condition type. "
+                                 "Got %s, Expected %s.",
+                                 ltype_name(cond->type), ltype_name(LVAL_NUM));
+            lval_del(cond);
+            lval_del(a);
+            return err;
+        }
+        int truth = cond->num != 0;
+        lval_del(cond);
+        if (!truth) { break; }
+
+        lval *x = lval_eval_copy(e, a->cell[1]);
+        if (x->type == LVAL_ERR) {
+            lval_del(a);
+            return x;
+        }
+        lval_del(x);
+    }
+
+    lval *empty_res = lval_sexpr(a->context);
+    lval_del(a);
+    return empty_res;
 }
 
-lval *builtin_print(lenv *e, lval *a) {
+/*
+ * Scope of a loop variable on top of e. Iterations overwrite its one slot
+ * instead of rebinding, so globals and their inline caches stay untouched.
+ */
+lenv *lenv_new_loop(lenv *e, lval *sym, lval *v) {
+    lenv *scope = lenv_new_local();
+    lenv_set_parent(scope, e);
+    scope->loop = 1;
+    lenv_set(scope, sym, v);
+    return scope;
+}
 
-    /* Print each argument followed by a space */
-    for (int i = 0; i < a->count; i++) {
-        lval_print(a->cell[i]);
-        putchar(' ');
+lval *builtin_dotimes(lenv *e, lval *a) {
+    LASSERT(a, a->cell[0]->count == 2 && a->cell[0]->cell[0]->type == LVAL_SYM,
+            "Function 'dotimes' expects {symbol count}.");
+
+    lval *n = lval_eval(e, lval_pop(a->cell[0], 1));
+    if (n->type != LVAL_NUM) {
+        lval *err = n->type == LVAL_ERR ? n :
+                    lval_err(n->context,
+                             "Function 'dotimes' passed incorrect count type. "
+                             "Got %s, Expected %s.",
+                             ltype_name(n->type), ltype_name(LVAL_NUM));
+        if (err != n) { lval_del(n); }
+        lval_del(a);
+        return err;
     }
 
-    /* Print a newline and delete arguments */
-    putchar('\n');
+    /* The counter is updated in place, the body may have replaced it */
+    lenv *scope = lenv_new_loop(e, a->cell[0]->cell[0], lval_num(0, a->context));
+    for (long i = 0; i < n->num; i++) {
+        if (scope->vals[0]->type == LVAL_NUM) {
+            scope->vals[0]->num = i;
+        } else {
+            lval_del(scope->vals[0]);
+            scope->vals[0] = lval_num(i, a->context);
+        }
+        lval *x = lval_eval_copy(scope, a->cell[1]);
+        if (x->type == LVAL_ERR) {
+            lenv_del(scope);
+            lval_del(n);
+            lval_del(a);
+            return x;
+        }
+        lval_del(x);
+    }
+    lenv_del(scope);
+    lval_del(n);
 
     lval *empty_res = lval_sexpr(a->context);
     lval_del(a);
     return empty_res;
 }
 
-lval *builtin_error(lenv *e, lval *a) {
-    LASSERT_NUM("error", a, 1);
-    LASSERT_TYPE("error", a, 0, LVAL_STR);
+lval *builtin_for_each(lenv *e, lval *a) {
+    LASSERT(a, a->cell[0]->count == 2 && a->cell[0]->cell[0]->type == LVAL_SYM,
+            "Function 'for-each' expects {symbol list}.");
+
+    lval *l = lval_eval(e, lval_pop(a->cell[0], 1));
+    if (l->type != LVAL_QEXPR) {
+        lval *err = l->type == LVAL_ERR ? l :
+                    lval_err(l->context,
+                             "Function 'for-each' passed incorrect list type. "
+                             "Got %s, Expected %s.",
+                             ltype_name(l->type), ltype_name(LVAL_QEXPR));
+        if (err != l) { lval_del(l); }
+        lval_del(a);
+        return err;
+    }
 
-    /* Construct Error from first argument */
-    lval *err = lval_err(a->context, a->cell[0]->str);
+    /* Each element is swapped into the variable, the list frees what it gets back */
+    lenv *scope = lenv_new_loop(e, a->cell[0]->cell[0], lval_sexpr(a->context));
+    for (int i = 0; i < l->count; i++) {
+        lval *prev = scope->vals[0];
+        scope->vals[0] = l->cell[i];
+        l->cell[i] = prev;
+        lval *x = lval_eval_copy(scope, a->cell[1]);
+        if (x->type == LVAL_ERR) {
+            lenv_del(scope);
+            lval_del(l);
+            lval_del(a);
+            return x;
+        }
+        lval_del(x);
+    }
+    lenv_del(scope);
+    lval_del(l);
 
-    /* Delete arguments and return */
+    lval *empty_res = lval_sexpr(a->context);
     lval_del(a);
-    return err;
+    return empty_res;
 }
 
-lval *lval_eval_sexpr(lenv *e, lval *v) {
+lval *builtin_select(lenv *e, lval *a) {
+    for (int i = 0; i < a->count; i++) {
+        LASSERT(a, a->cell[i]->count == 2,
+                "Function 'select' passed invalid clause %i. "
+                "Got %i items, Expected 2.", i, a->cell[i]->count);
+    }
 
-    /* Evaluate Children */
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+    /* Conditions are evaluated in order, only the chosen body runs */
+    for (int i = 0; i < a->count; i++) {
+        lval *clause = a->cell[i];
+        lval *cond = lval_eval(e, lval_pop(clause, 0));
+        if (cond->type == LVAL_ERR) {
+            lval_del(a);
+            return cond;
+        }
+        if (cond->type != LVAL_NUM) {
+            lval *err = lval_err(cond->context,
+                                 "Function 'select' passed incorrect condition type. "
+                                 "Got %s, Expected %s.",
+                                 ltype_name(cond->type), ltype_name(LVAL_NUM));
+            lval_del(cond);
+            lval_del(a);
+            return err;
+        }
+        int truth = cond->num != 0;
+        lval_del(cond);
+        if (truth) {
+            lval *body = lval_pop(clause, 0);
+            lval_del(a);
+            return lval_eval(e, body);
+        }
     }
 
-    /* Error Checking */
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+    lval *err = lval_err(a->context, "No Selection Found");
+    lval_del(a);
+    return err;
+}
+
+/* Clause of a case call whose key equals x, 0 if none */
+int lcase_find(lcase *t, lval *a, lval *x) {
+    unsigned long h = lval_hash(x);
+    int slot = (int) (h & (unsigned long) (t->size - 1));
+    while (t->index[slot]) {
+        int i = t->index[slot];
+        if (t->hashes[slot] == h && lval_eq(x, a->cell[i]->cell[0])) { return i; }
+        slot = (slot + 1) & (t->size - 1);
     }
+    return 0;
+}
 
-    /* Empty Expression */
-    if (v->count == 0) { return v; }
+lval *builtin_case(lenv *e, lval *a) {
+    lval *x = a->cell[0];
+    int chosen = 0;
 
-    /* Single Expression */
-    if (v->count == 1) { return lval_take(v, 0); }
+    /* Literal clauses were checked and put in a table when the code was read */
+    if (a->jump && a->jump->count == a->count) {
+        chosen = lcase_find(a->jump, a, x);
+    } else {
+        for (int i = 1; i < a->count; i++) {
+            LASSERT(a, a->cell[i]->count == 2,
+                    "Function 'case' passed invalid clause %i. "
+                    "Got %i items, Expected 2.", i, a->cell[i]->count);
+        }
 
-    /* Ensure First Element is Function */
-    lval *f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval *err = lval_err(
-                f->context,
-                "S-Expression starts with incorrect type. "
-                "Got %s, Expected %s.",
-                ltype_name(f->type), ltype_name(LVAL_FUN));
-        lval_del(f);
-        lval_del(v);
+        /* Otherwise keys are evaluated in order */
+        for (int i = 1; i < a->count && !chosen; i++) {
+            lval *key = lval_eval(e, lval_pop(a->cell[i], 0));
+            if (key->type == LVAL_ERR) {
+                lval_del(a);
+                return key;
+            }
+            if (lval_eq(x, key)) { chosen = i; }
+            lval_del(key);
+        }
+    }
+
+    if (!chosen) {
+        lval *err = lval_err(a->context, "No Case Found");
+        lval_del(a);
         return err;
     }
 
-    lval *result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
+    lval *body = lval_pop(a->cell[chosen], a->cell[chosen]->count - 1);
+    lval_del(a);
+    return lval_eval(e, body);
 }
 
-lval *lval_eval(lenv *e, lval *v) {
-    if (v->type == LVAL_SYM) {
-        lval *x = lenv_get(e, v);
-        lval_del(v);
-        return x;
-    }
-    if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
-    return v;
+lval *builtin_not(lenv *e, lval **argv, int argc) {
+    return builtin_bool(argv, !argv[0]->num);
 }
 
+lval *builtin_print(lenv *e, lval *a) {
 
-lval *lval_call(lenv *e, lval *f, lval *a) {
-
-    /* If Builtin then simply apply that */
-    if (f->builtin) { return f->builtin(e, a); }
+    /* Print each argument followed by a space */
+    for (int i = 0; i < a->count; i++) {
+        lval_print(a->cell[i]);
+        lout_putc(' ');
+    }
 
-    /* Record Argument Counts */
-    int given = a->count;
-    int total = f->formals->count;
+    /* Print a newline and delete arguments */
+    lout_putc('\n');
 
-    /* While arguments still remain to be processed */
-    while (a->count) {
+    lval *empty_res = lval_sexpr(a->context);
+    lval_del(a);
+    return empty_res;
+}
 
-        /* If we've ran out of formal arguments to bind */
-        if (f->formals->count == 0) {
-            lval_del(a);
-            return lval_err(f->context,
-                            "Function passed too many arguments. "
-                            "Got %i, Expected %i.", given, total);
-        }
+lval *builtin_error(lenv *e, lval *a) {
+    /* Construct Error from first argument */
+    lval *err = lval_err_str(a->cell[0], a->context);
 
-        /* Pop the first symbol from the formals */
-        lval *sym = lval_pop(f->formals, 0);
+    /* Delete arguments and return */
+    lval_del(a);
+    return err;
+}
 
-        /* Special Case to deal with '&' (varargs) */
-        if (strcmp(sym->sym, "&") == 0) {
+lval *builtin_str_len(lenv *e, lval **argv, int argc) {
+    return lval_num((long) argv[0]->len, argv[0]->context);
+}
 
-            /* Ensure '&' is followed by another symbol */
-            if (f->formals->count != 1) {
-                lval_del(a);
-                return lval_err(sym->context,
-                                "Function format invalid. "
-                                "Symbol '&' not followed by single symbol.");
-            }
+lval *builtin_substr(lenv *e, lval *a) {
+    lval *s = a->cell[0];
+    long start = a->cell[1]->num;
+    long count = a->cell[2]->num;
+    LASSERT(a, start >= 0 && count >= 0,
+            "Function 'substr' passed negative index or length.");
 
-            /* Next formal should be bound to remaining arguments */
-            lval *nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
-            break;
-        }
+    /* Clamp the range to the end of the string */
+    if ((size_t) start > s->len) { start = (long) s->len; }
+    if ((size_t) count > s->len - start) { count = (long) (s->len - start); }
 
-        /* Pop the next argument from the list */
-        lval *val = lval_pop(a, 0);
+    lval *res = lval_str_n(s->str + start, (size_t) count, a->context);
+    lval_del(a);
+    return res;
+}
 
-        /* Bind a copy into the function's environment */
-        lenv_put(f->env, sym, val);
+lval *builtin_concat(lenv *e, lval *a) {
+    size_t len = 0;
+    for (int i = 0; i < a->count; i++) { len += a->cell[i]->len; }
 
-        /* Delete symbol and value */
-        lval_del(sym);
-        lval_del(val);
+    /* Allocate the result once and copy every part into it */
+    lval *res = lval_str_alloc(len, a->context);
+    char *out = res->str;
+    for (int i = 0; i < a->count; i++) {
+        memcpy(out, a->cell[i]->str, a->cell[i]->len);
+        out += a->cell[i]->len;
     }
 
-    /* Argument list is now bound so can be cleaned up */
     lval_del(a);
+    return res;
+}
 
-    /* If '&' remains in formal list bind to empty list */
-    if (f->formals->count > 0 &&
-        strcmp(f->formals->cell[0]->sym, "&") == 0) {
+lval *builtin_split_str(lenv *e, lval *a) {
+    LASSERT(a, a->cell[1]->len != 0,
+            "Function 'split-str' passed empty separator.");
 
-        /* Check to ensure that & is not passed invalidly. */
-        if (f->formals->count != 2) {
-            return lval_err(f->context,
-                            "Function format invalid. "
-                            "Symbol '&' not followed by single symbol.");
-        }
+    lval *s = a->cell[0];
+    lval *sep = a->cell[1];
+    const char *end = s->str + s->len;
 
-        /* Pop and delete '&' symbol */
-        lval_del(lval_pop(f->formals, 0));
+    /* Count the pieces first so the list is allocated only once */
+    int pieces = 1;
+    for (const char *p = s->str;
+         (p = str_find(p, (size_t) (end - p), sep->str, sep->len));
+         p += sep->len) {
+        pieces++;
+    }
 
-        /* Pop next symbol and create empty list */
-        lval *sym = lval_pop(f->formals, 0);
-        lval *val = lval_qexpr(sym->context);
+    lval *res = lval_qexpr(a->context);
+    res->count = pieces;
+    res->cell = calloc((size_t) pieces, sizeof(lval *));
 
-        /* Bind to environment and delete */
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
-        lval_del(val);
+    const char *start = s->str;
+    for (int i = 0; i < pieces - 1; i++) {
+        const char *p = str_find(start, (size_t) (end - start), sep->str, sep->len);
+        res->cell[i] = lval_str_n(start, (size_t) (p - start), a->context);
+        start = p + sep->len;
     }
+    res->cell[pieces - 1] = lval_str_n(start, (size_t) (end - start), a->context);
 
-    /* If all formals have been bound evaluate */
-    if (f->formals->count == 0) {
-
-        /* Set environment parent to evaluation environment */
-        f->env->parent = e;
+    lval_del(a);
+    return res;
+}
 
-        lval *body = lval_add(lval_sexpr(f->body->context), lval_copy(f->body));
+lval *builtin_join_str(lenv *e, lval *a) {
+    lval *sep = a->cell[0];
+    lval *parts = a->cell[1];
 
-        /* Evaluate and return */
-        return builtin_eval(f->env, body);
-    } else {
-        /* Otherwise return partially evaluated function */
-        return lval_copy(f);
+    size_t len = 0;
+    for (int i = 0; i < parts->count; i++) {
+        LASSERT(a, parts->cell[i]->type == LVAL_STR,
+                "Function 'join-str' passed incorrect type in list. "
+                "Got %s, Expected %s.",
+                ltype_name(parts->cell[i]->type), ltype_name(LVAL_STR));
+        len += parts->cell[i]->len;
+    }
+    if (parts->count > 1) { len += sep->len * (size_t) (parts->count - 1); }
+
+    lval *res = lval_str_alloc(len, a->context);
+    char *out = res->str;
+    for (int i = 0; i < parts->count; i++) {
+        if (i != 0) {
+            memcpy(out, sep->str, sep->len);
+            out += sep->len;
+        }
+        memcpy(out, parts->cell[i]->str, parts->cell[i]->len);
+        out += parts->cell[i]->len;
     }
 
+    lval_del(a);
+    return res;
 }
 
-lval *builtin_load_file(lenv *e, char *file, code_context *c) {
-    char *file_content = load_file(file);
-    if (file_content == NULL)
-        return lval_err(c, "Could not load '%s': Failed to load file", file);
+lval *builtin_find(lenv *e, lval *a) {
+    lval *s = a->cell[0];
+    const char *p = str_find(s->str, s->len, a->cell[1]->str, a->cell[1]->len);
 
-    ast *tree = parse(file_content);
+    lval *num = lval_num(p ? (long) (p - s->str) : -1, a->context);
+    lval_del(a);
+    return num;
+}
 
-    if (tree->type != AST_ERROR) {
-        lval *expr = lval_read(tree);
+lval *builtin_replace(lenv *e, lval *a) {
+    LASSERT(a, a->cell[1]->len != 0,
+            "Function 'replace' passed empty search string.");
+
+    lval *s = a->cell[0];
+    lval *old = a->cell[1];
+    lval *new = a->cell[2];
+    const char *end = s->str + s->len;
+
+    /* Count matches so the result can be sized up front */
+    size_t matches = 0;
+    for (const char *p = s->str;
+         (p = str_find(p, (size_t) (end - p), old->str, old->len));
+         p += old->len) {
+        matches++;
+    }
 
-        /* Evaluate each Expression */
-        while (expr->count) {
-            lval *x = lval_eval(e, lval_pop(expr, 0));
-            /* If Evaluation leads to error print it */
-            if (x->type == LVAL_ERR) { lval_println(x); }
-            lval_del(x);
-        }
+    lval *res = lval_str_alloc(s->len - matches * old->len + matches * new->len, a->context);
+    char *out = res->str;
+    const char *start = s->str;
+    for (size_t i = 0; i < matches; i++) {
+        const char *p = str_find(start, (size_t) (end - start), old->str, old->len);
+        memcpy(out, start, (size_t) (p - start));
+        out += p - start;
+        memcpy(out, new->str, new->len);
+        out += new->len;
+        start = p + old->len;
+    }
+    memcpy(out, start, (size_t) (end - start));
 
-        free_ast(tree);
-        lval_del(expr);
+    lval_del(a);
+    return res;
+}
 
-        return lval_sexpr(c);
-    } else {
-        lval *err = lval_err(tree->context, "Could not load %s: \n%s", file, tree->val);
+lval *builtin_starts_with(lenv *e, lval *a) {
+    lval *s = a->cell[0];
+    lval *prefix = a->cell[1];
+    int r = prefix->len <= s->len && memcmp(s->str, prefix->str, prefix->len) == 0;
 
-        free_ast(tree);
+    lval *num = lval_num(r, a->context);
+    lval_del(a);
+    return num;
+}
 
-        return err;
-    }
+lval *builtin_to_num(lenv *e, lval *a) {
+    lval *s = a->cell[0];
+    char *end;
+    errno = 0;
+    long x = strtol(s->str, &end, 10);
+    LASSERT(a, s->len != 0 && end == s->str + s->len && errno != ERANGE,
+            "Function 'to-num' passed invalid number \"%s\".", s->str);
+
+    lval *num = lval_num(x, a->context);
+    lval_del(a);
+    return num;
 }
 
-lval *builtin_load_file_lval(lenv *e, lval *file) {
-    LASSERT_NUM("load", file, 1);
-    LASSERT_TYPE("load", file, 0, LVAL_STR);
+lval *builtin_num_to_str(lenv *e, lval *a) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%li", a->cell[0]->num);
 
-    return builtin_load_file(e, file->cell[0]->str, file->context);
+    lval *str = lval_str_n(buf, (size_t) len, a->context);
+    lval_del(a);
+    return str;
 }
 
-void lenv_add_builtins(lenv *e) {
-    /* List Functions */
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
-
-    /* Mathematical Functions */
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
-    lenv_add_builtin(e, "%", builtin_mod);
-
-    /* Variable Functions */
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "=", builtin_put);
-
-
-    /* Exit REPL */
-    lenv_add_builtin(e, "exit", builtin_exit);
-
-    /* User defined functions */
-    lenv_add_builtin(e, "lambda", builtin_lambda);
-    lenv_add_builtin(e, "fun", builtin_fun);
-
-    /* Conditionals Functions */
-    lenv_add_builtin(e, "if", builtin_if);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-    lenv_add_builtin(e, "<", builtin_gt);
-    lenv_add_builtin(e, "<=", builtin_ge);
-    lenv_add_builtin(e, ">", builtin_lt);
-    lenv_add_builtin(e, ">=", builtin_le);
-    lenv_add_builtin(e, "||", builtin_or);
-    lenv_add_builtin(e, "&&", builtin_and);
-    lenv_add_builtin(e, "!", builtin_not);
-    lenv_put(e, lval_sym("true", NULL), lval_num(1, NULL));
-    lenv_put(e, lval_sym("false", NULL), lval_num(0, NULL));
+lval *builtin_hash_cons(lenv *e, lval *a) {
+    LASSERT_ALONE("hash-cons", a);
 
-    /* Generic Functions */
-    /* String Functions */
-    lenv_add_builtin(e, "load", builtin_load_file_lval);
-    lenv_add_builtin(e, "error", builtin_error);
-    lenv_add_builtin(e, "print", builtin_print);
+    /* Toggle sharing of long literals, returns the previous setting */
+    lval *prev = lval_num(lval_hash_consing, a->context);
+    lval_hash_consing = a->cell[0]->num != 0;
+    lval_del(a);
+    return prev;
 }
 
-void load_input_files(int argc, char **argv, lenv *e) {
-    /* first file is always standard lib*/
+lval *builtin_optimize(lenv *e, lval *a) {
+    LASSERT_SERIAL("optimize", a);
+
+    /* Applies until the end of the file being loaded */
+    lstate *s = lenv_state(e);
+    lval *prev = lval_num(s->optimize, a->context);
+    s->optimize = a->cell[0]->num != 0;
+    lval_del(a);
+    return prev;
+}
+
+lval *builtin_try(lenv *e, lval *a) {
+    /* The fallback runs on failure, the error message is never built */
+    lval *x = lval_eval_copy(e, a->cell[0]);
+    if (x->type == LVAL_ERR) {
+        lval_del(x);
+        x = lval_eval_copy(e, a->cell[1]);
+    }
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_catch(lenv *e, lval *a) {
+    /* On failure the handler is called with the error message */
+    lval *x = lval_eval_copy(e, a->cell[0]);
+    if (x->type == LVAL_ERR) {
+        char *msg = lval_err_msg(x);
+        lval *args = lval_sexpr(x->context);
+        lval_add(args, lval_str_n(msg, x->len, x->context));
+        lval_del(x);
+        x = lval_call(e, a->cell[1], args);
+    }
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_apply(lenv *e, lval *a) {
+    /* Call directly with the list as arguments, nothing is re-evaluated */
+    lval *f = lval_pop(a, 0);
+    lval *args = lval_take(a, 0);
+    args->type = LVAL_SEXPR;
+
+    lval *result = lval_call(e, f, args);
+    lval_del(f);
+    return result;
+}
+
+lval *builtin_memo(lenv *e, lval *a) {
+    long capacity = 0;
+    if (a->count == 2) {
+        LASSERT(a, a->cell[1]->num > 0,
+                "Function 'memo' passed non-positive capacity %li.", a->cell[1]->num);
+        capacity = a->cell[1]->num;
+    }
+
+    lval *v = lval_func(NULL);
+    v->memo = lmemo_new(lval_pop(a, 0), capacity);
+    v->context = copy_context(a->context);
+    lval_del(a);
+    return v;
+}
+
+/*
+ * Parallel map, filter and reduce over the pool in pool.c. The first
+ * items are done on the calling thread, which fills the inline caches of
+ * the function's code before the workers only read them. The function is
+ * shared by the workers and must not change globals.
+ */
+typedef struct lparallel {
+    lenv *e;
+    lval *fn;
+    lval **items;
+    lval **results;
+
+    /* Set by the first error, later chunks are skipped */
+    atomic_int failed;
+} lparallel;
+
+lval *lparallel_call(lparallel *p, lval *x, lval *y) {
+    lval *args = lval_add(lval_sexpr(NULL), x);
+    if (y) { lval_add(args, y); }
+    return lval_call(p->e, p->fn, args);
+}
+
+/* Results are new values, the items are taken by pmap and copied by pfilter */
+void lparallel_map(ljob *job, int begin, int end) {
+    lparallel *p = job->data;
+    for (int i = begin; i < end && !atomic_load_explicit(&p->failed, memory_order_relaxed); i++) {
+        lval *x = p->items[i];
+        p->items[i] = NULL;
+        p->results[i] = lparallel_call(p, x, NULL);
+        if (p->results[i]->type == LVAL_ERR) { atomic_store(&p->failed, 1); }
+    }
+}
+
+void lparallel_filter(ljob *job, int begin, int end) {
+    lparallel *p = job->data;
+    for (int i = begin; i < end && !atomic_load_explicit(&p->failed, memory_order_relaxed); i++) {
+        p->results[i] = lparallel_call(p, lval_copy(p->items[i]), NULL);
+        if (p->results[i]->type == LVAL_ERR) { atomic_store(&p->failed, 1); }
+    }
+}
+
+/* Each chunk is folded from its first item, the result kept in that slot */
+void lparallel_reduce(ljob *job, int begin, int end) {
+    lparallel *p = job->data;
+    lval *acc = p->items[begin];
+    p->items[begin] = NULL;
+    for (int i = begin + 1; i < end && acc->type != LVAL_ERR; i++) {
+        acc = lparallel_call(p, acc, p->items[i]);
+        p->items[i] = NULL;
+    }
+    if (acc->type == LVAL_ERR) { atomic_store(&p->failed, 1); }
+    p->results[begin] = acc;
+}
+
+/* Run over every item of the list, first done serially */
+void lparallel_run(lparallel *p, void (*run)(ljob *, int, int), int n, int first) {
+    ljob job;
+    job.run = run;
+    job.data = p;
+    atomic_init(&job.pending, 0);
+    atomic_init(&p->failed, 0);
+    p->results = calloc((size_t) n + 1, sizeof(lval *));
+
+    if (first > n) { first = n; }
+    int parallel = lval_parallel;
+    if (lval_parallel == 0) { lval_parallel = 1; }
+    if (first > 0) { run(&job, 0, first); }
+
+    /* A few chunks per thread leaves room for stealing */
+    int threads = lval_pool.threads > 0 ? lval_pool.threads : lpool_default_threads();
+    int grain = (n - first) / (threads * 4);
+    if (grain < 1) { grain = 1; }
+    if (!atomic_load(&p->failed)) { lpool_run(&job, first, n, grain); }
+    lval_parallel = parallel;
+}
+
+/* First error among the results, NULL if there is none */
+lval *lparallel_error(lparallel *p, int n) {
+    for (int i = 0; i < n; i++) {
+        if (p->results[i] && p->results[i]->type == LVAL_ERR) {
+            lval *err = p->results[i];
+            p->results[i] = NULL;
+            return err;
+        }
+    }
+    return NULL;
+}
+
+void lparallel_free(lparallel *p, lval *list, int n) {
+    for (int i = 0; i < n; i++) {
+        if (p->results[i]) { lval_del(p->results[i]); }
+        if (list->cell[i]) { lval_del(list->cell[i]); }
+    }
+    list->count = 0;
+    free(p->results);
+}
+
+lval *builtin_pmap(lenv *e, lval *a) {
+    lval *list = a->cell[1];
+    int n = list->count;
+    lparallel p = {e, a->cell[0], list->cell, NULL};
+    lparallel_run(&p, lparallel_map, n, 1);
+
+    lval *err = lparallel_error(&p, n);
+    if (err) {
+        lparallel_free(&p, list, n);
+        lval_del(a);
+        return err;
+    }
+
+    /* The results become the cells of the new list */
+    lval *r = lval_qexpr(a->context);
+    r->cell = p.results;
+    r->count = n;
+    list->count = 0;
+    lval_del(a);
+    return r;
+}
+
+lval *builtin_pfilter(lenv *e, lval *a) {
+    lval *list = a->cell[1];
+    int n = list->count;
+    lparallel p = {e, a->cell[0], list->cell, NULL};
+    lparallel_run(&p, lparallel_filter, n, 1);
+
+    lval *err = lparallel_error(&p, n);
+    for (int i = 0; !err && i < n; i++) {
+        if (p.results[i]->type != LVAL_NUM) {
+            err = lval_err(a->context, "Function 'pfilter' predicate returned %s, Expected %s.",
+                           ltype_name(p.results[i]->type), ltype_name(LVAL_NUM));
+        }
+    }
+    if (err) {
+        lparallel_free(&p, list, n);
+        lval_del(a);
+        return err;
+    }
+
+    lval *r = lval_qexpr(a->context);
+    for (int i = 0; i < n; i++) {
+        if (p.results[i]->num) {
+            lval_add(r, list->cell[i]);
+            list->cell[i] = NULL;
+        }
+    }
+    lparallel_free(&p, list, n);
+    lval_del(a);
+    return r;
+}
+
+lval *builtin_preduce(lenv *e, lval *a) {
+    lval *list = a->cell[2];
+    int n = list->count;
+    lparallel p = {e, a->cell[0], list->cell, NULL};
+
+    /* Chunks are folded on their own, the results then from the initial value */
+    lparallel_run(&p, lparallel_reduce, n, 2);
+    lval *err = lparallel_error(&p, n);
+    if (err) {
+        lparallel_free(&p, list, n);
+        lval_del(a);
+        return err;
+    }
+
+    lval *acc = lval_pop(a, 1);
+    for (int i = 0; i < n && acc->type != LVAL_ERR; i++) {
+        if (p.results[i] == NULL) { continue; }
+        acc = lparallel_call(&p, acc, p.results[i]);
+        p.results[i] = NULL;
+    }
+    lparallel_free(&p, list, n);
+    lval_del(a);
+    return acc;
+}
+
+lval *builtin_threads(lenv *e, lval *a) {
+    LASSERT_ALONE("threads", a);
+    LASSERT(a, a->cell[0]->num >= 0,
+            "Function 'threads' passed negative count %li.", a->cell[0]->num);
+
+    /* Sets the pool size and returns the previous one, 0 only returns it */
+    long n = a->cell[0]->num;
+    lval *prev;
+    if (n == 0) {
+        prev = lval_num(lval_pool.threads > 0 ? lval_pool.threads : lpool_default_threads(),
+                        a->context);
+    } else {
+        prev = lval_num(lpool_resize((int) n), a->context);
+    }
+    lval_del(a);
+    return prev;
+}
+
+lsched *lenv_sched(lenv *e) {
+    lstate *s = lenv_state(e);
+    if (s->sched == NULL) { s->sched = lsched_new(); }
+    return s->sched;
+}
+
+lval *builtin_spawn(lenv *e, lval *a) {
+    LASSERT_SERIAL("spawn", a);
+
+    /* Tasks outlive the scope spawning them, they run in the global one */
+    lval *fn = lval_pop(a, 0);
+    int id = lsched_spawn(lenv_sched(e), e->global, fn, lval_copy(a));
+    if (id == 0) {
+        lval_del(fn);
+        lval *err = lval_err(a->context, "Function 'spawn' could not map a stack: %s", strerror(errno));
+        lval_del(a);
+        return err;
+    }
+    lval *r = lval_num(id, a->context);
+    lval_del(a);
+    return r;
+}
+
+lval *builtin_yield(lenv *e, lval *a) {
+    LASSERT_SERIAL("yield", a);
+    lsched_yield(lenv_sched(e));
+    return lval_take(a, 0);
+}
+
+lval *builtin_chan(lenv *e, lval *a) {
+    LASSERT_SERIAL("chan", a);
+    LASSERT(a, a->cell[0]->num >= 0 && a->cell[0]->num <= INT_MAX,
+            "Function 'chan' passed invalid capacity %li.", a->cell[0]->num);
+
+    lval *r = lval_num(lsched_chan(lenv_sched(e), (int) a->cell[0]->num), a->context);
+    lval_del(a);
+    return r;
+}
+
+lval *builtin_send(lenv *e, lval *a) {
+    LASSERT_SERIAL("send", a);
+    lsched *s = lenv_sched(e);
+    lchan *c = lsched_chan_get(s, a->cell[0]->num);
+    LASSERT(a, c, "Function 'send' passed unknown channel %li.", a->cell[0]->num);
+
+    if (!lsched_send(s, c, lval_pop(a, 1))) {
+        lval *err = lval_err(a->context, "Function 'send' would wait forever, every task is waiting.");
+        lval_del(a);
+        return err;
+    }
+    lval *r = lval_sexpr(a->context);
+    lval_del(a);
+    return r;
+}
+
+lval *builtin_recv(lenv *e, lval *a) {
+    LASSERT_SERIAL("recv", a);
+    lsched *s = lenv_sched(e);
+    lchan *c = lsched_chan_get(s, a->cell[0]->num);
+    LASSERT(a, c, "Function 'recv' passed unknown channel %li.", a->cell[0]->num);
+
+    lval *v = lsched_recv(s, c);
+    if (v == NULL) {
+        v = lval_err(a->context, "Function 'recv' would wait forever, every task is waiting.");
+    }
+    lval_del(a);
+    return v;
+}
+
+/* Open file numbered h of the interpreter, NULL if there is none */
+lfile *lenv_file(lenv *e, long h) {
+    lstate *s = lenv_state(e);
+    if (h < 1 || h > s->file_count) { return NULL; }
+    return s->files[h - 1];
+}
+
+#define LASSERT_FILE(func, args, f, write) \
+  LASSERT(args, f, "Function '%s' passed unknown file %li.", func, args->cell[0]->num); \
+  LASSERT(args, f->writing == write, "Function '%s' passed a file not open for %s.", \
+    func, write ? "writing" : "reading")
+
+lval *builtin_open(lenv *e, lval *a) {
+    LASSERT_SERIAL("open", a);
+    lfile *f = lfile_open(a->cell[0]->str, a->cell[1]->str);
+    LASSERT(a, f, "Could not open '%s': %s", a->cell[0]->str, strerror(errno));
+
+    lstate *s = lenv_state(e);
+    s->files = realloc(s->files, sizeof(lfile *) * (size_t) (s->file_count + 1));
+    s->files[s->file_count++] = f;
+    lval *h = lval_num(s->file_count, a->context);
+    lval_del(a);
+    return h;
+}
+
+/* Line of f as a string, {} at the end of the file */
+lval *lval_read_line(lfile *f, code_context *c) {
+    const char *line;
+    size_t len;
+    if (!lfile_line(f, &line, &len)) { return lval_qexpr(c); }
+    return lval_str_n(line, len, c);
+}
+
+lval *builtin_read_line(lenv *e, lval *a) {
+    LASSERT_SERIAL("read-line", a);
+    lfile *f = lenv_file(e, a->cell[0]->num);
+    LASSERT_FILE("read-line", a, f, 0);
+
+    lval *line = lval_read_line(f, a->context);
+    lval_del(a);
+    return line;
+}
+
+lval *builtin_lines(lenv *e, lval *a) {
+    LASSERT_SERIAL("lines", a);
+    lfile *f = lenv_file(e, a->cell[0]->num);
+    LASSERT_FILE("lines", a, f, 0);
+
+    /* Without a function the lines are a lazy sequence */
+    if (a->count == 1) {
+        lval *v = lval_seq(LSEQ_LINES, a->context);
+        v->seq->n = a->cell[0]->num;
+        lval_del(a);
+        return v;
+    }
+
+    /* Each line is read once the previous call is done with */
+    long count = 0;
+    lval *line;
+    while ((line = lval_read_line(f, a->context))->type == LVAL_STR) {
+        lval *x = lval_call(e, a->cell[1], lval_add(lval_sexpr(a->context), line));
+        if (x->type == LVAL_ERR) {
+            lval_del(a);
+            return x;
+        }
+        lval_del(x);
+        count++;
+    }
+    lval_del(line);
+    lval *r = lval_num(count, a->context);
+    lval_del(a);
+    return r;
+}
+
+lval *builtin_read_bytes(lenv *e, lval *a) {
+    LASSERT_SERIAL("read-bytes", a);
+    lfile *f = lenv_file(e, a->cell[0]->num);
+    LASSERT_FILE("read-bytes", a, f, 0);
+    LASSERT(a, a->cell[1]->num > 0,
+            "Function 'read-bytes' passed invalid count %li.", a->cell[1]->num);
+
+    const char *bytes;
+    size_t len = lfile_bytes(f, (size_t) a->cell[1]->num, &bytes);
+    lval *r = len ? lval_str_n(bytes, len, a->context) : lval_qexpr(a->context);
+    lval_del(a);
+    return r;
+}
+
+lval *builtin_write(lenv *e, lval *a) {
+    LASSERT_SERIAL("write", a);
+    lfile *f = lenv_file(e, a->cell[0]->num);
+    LASSERT_FILE("write", a, f, 1);
+
+    for (int i = 1; i < a->count; i++) {
+        LASSERT(a, lfile_write(f, a->cell[i]->str, a->cell[i]->len),
+                "Function 'write' failed: %s", strerror(errno));
+    }
+    lval *r = lval_sexpr(a->context);
+    lval_del(a);
+    return r;
+}
+
+lval *builtin_flush(lenv *e, lval *a) {
+    LASSERT_SERIAL("flush", a);
+    lfile *f = lenv_file(e, a->cell[0]->num);
+    LASSERT_FILE("flush", a, f, 1);
+    LASSERT(a, lfile_flush(f), "Function 'flush' failed: %s", strerror(errno));
+
+    lval *r = lval_sexpr(a->context);
+    lval_del(a);
+    return r;
+}
+
+lval *builtin_close(lenv *e, lval *a) {
+    LASSERT_SERIAL("close", a);
+    lfile *f = lenv_file(e, a->cell[0]->num);
+    LASSERT(a, f, "Function 'close' passed unknown file %li.", a->cell[0]->num);
+
+    /* Numbers are not reused, a closed file stays unknown */
+    lenv_state(e)->files[a->cell[0]->num - 1] = NULL;
+    LASSERT(a, lfile_close(f), "Function 'close' failed: %s", strerror(errno));
+    lval *r = lval_sexpr(a->context);
+    lval_del(a);
+    return r;
+}
+
+/*
+ * Lazy sequences hold how to produce their items rather than the items,
+ * which are produced one at a time as they are read. Each reader walks a
+ * sequence with an iterator of its own, so reading never changes it,
+ * except for the lines of a file which are read from the file once.
+ * A chunked lazy-map takes a chunk of items at a time and maps them on
+ * the pool like pmap.
+ */
+typedef struct lseq_iter {
+    lseq *seq;
+
+    /* Items produced so far, the next number of a range */
+    long count;
+    long next;
+    int done;
+
+    /* Last item of iterate */
+    lval *value;
+
+    /* Iterator of the sequence read by map, filter and take */
+    struct lseq_iter *source;
+
+    /* Mapped items of the current chunk, handed out from chunk_pos */
+    lval **chunk;
+    int chunk_count;
+    int chunk_pos;
+} lseq_iter;
+
+lseq_iter *lseq_iter_new(lseq *s) {
+    lseq_iter *it = calloc(1, sizeof(lseq_iter));
+    it->seq = s;
+    it->next = s->from;
+    if (s->source) { it->source = lseq_iter_new(s->source->seq); }
+    return it;
+}
+
+void lseq_chunk_free(lseq_iter *it) {
+    for (int i = it->chunk_pos; i < it->chunk_count; i++) { lval_del(it->chunk[i]); }
+    free(it->chunk);
+    it->chunk = NULL;
+    it->chunk_count = 0;
+    it->chunk_pos = 0;
+}
+
+void lseq_iter_free(lseq_iter *it) {
+    if (it->source) { lseq_iter_free(it->source); }
+    if (it->value) { lval_del(it->value); }
+    lseq_chunk_free(it);
+    free(it);
+}
+
+/* Whether reading all of s would never finish */
+int lseq_endless(lseq *s) {
+    switch (s->kind) {
+        case LSEQ_RANGE:
+            return s->to == (s->step > 0 ? LONG_MAX : LONG_MIN);
+        case LSEQ_ITERATE:
+        case LSEQ_REPEAT:
+            return 1;
+        case LSEQ_MAP:
+        case LSEQ_FILTER:
+            return lseq_endless(s->source->seq);
+        default:
+            return 0;
+    }
+}
+
+lval *lseq_next(lenv *e, lseq_iter *it, code_context *c);
+
+/* Map the next chunk of items on the pool, NULL or an error, no chunk at the end */
+lval *lseq_map_chunk(lenv *e, lseq_iter *it, code_context *c) {
+    lseq *s = it->seq;
+    lseq_chunk_free(it);
+
+    lval **items = calloc((size_t) s->n, sizeof(lval *));
+    int n = 0;
+    while (n < s->n) {
+        lval *x = lseq_next(e, it->source, c);
+        if (x == NULL) { break; }
+        if (x->type == LVAL_ERR) {
+            for (int i = 0; i < n; i++) { lval_del(items[i]); }
+            free(items);
+            return x;
+        }
+        items[n++] = x;
+    }
+    if (n == 0) {
+        free(items);
+        return NULL;
+    }
+
+    lparallel p = {e, s->fn, items, NULL};
+    lparallel_run(&p, lparallel_map, n, 1);
+    lval *err = lparallel_error(&p, n);
+    for (int i = 0; i < n; i++) {
+        if (items[i]) { lval_del(items[i]); }
+        if (err && p.results[i]) { lval_del(p.results[i]); }
+    }
+    free(items);
+    if (err) {
+        free(p.results);
+        return err;
+    }
+    it->chunk = p.results;
+    it->chunk_count = n;
+    return NULL;
+}
+
+/* Next item read by it, NULL at the end or an error */
+lval *lseq_next(lenv *e, lseq_iter *it, code_context *c) {
+    lseq *s = it->seq;
+    lval *x;
+    switch (s->kind) {
+        case LSEQ_RANGE: {
+            if (it->done || (s->step > 0 ? it->next >= s->to : it->next <= s->to)) { return NULL; }
+            long v = it->next;
+            /* Stop rather than wrap around */
+            if (s->step > 0 ? v > LONG_MAX - s->step : v < LONG_MIN - s->step) {
+                it->done = 1;
+            } else {
+                it->next += s->step;
+            }
+            return lval_num(v, c);
+        }
+        case LSEQ_ITERATE:
+            /* f is only called once the item after the last is read */
+            if (it->value) {
+                x = lval_call(e, s->fn, lval_add(lval_sexpr(c), it->value));
+                it->value = NULL;
+                if (x->type == LVAL_ERR) { return x; }
+                it->value = x;
+            } else {
+                it->value = lval_copy(s->value);
+            }
+            return lval_copy(it->value);
+        case LSEQ_REPEAT:
+            return lval_copy(s->value);
+        case LSEQ_LIST:
+            if (it->count == s->value->count) { return NULL; }
+            return lval_copy(s->value->cell[it->count++]);
+        case LSEQ_LINES: {
+            if (lval_parallel) {
+                return lval_err(c, "Lines of file %li cannot be read inside parallel work.", s->n);
+            }
+            lfile *f = lenv_file(e, s->n);
+            if (f == NULL) { return lval_err(c, "Lines of file %li read after it was closed.", s->n); }
+            x = lval_read_line(f, c);
+            if (x->type == LVAL_STR) { return x; }
+            lval_del(x);
+            return NULL;
+        }
+        case LSEQ_TAKE:
+            if (it->count == s->n) { return NULL; }
+            it->count++;
+            return lseq_next(e, it->source, c);
+        case LSEQ_MAP:
+            if (s->n > 1) {
+                if (it->chunk_pos == it->chunk_count) {
+                    x = lseq_map_chunk(e, it, c);
+                    if (x || it->chunk_count == 0) { return x; }
+                }
+                x = it->chunk[it->chunk_pos];
+                it->chunk[it->chunk_pos++] = NULL;
+                return x;
+            }
+            x = lseq_next(e, it->source, c);
+            if (x == NULL || x->type == LVAL_ERR) { return x; }
+            return lval_call(e, s->fn, lval_add(lval_sexpr(c), x));
+        case LSEQ_FILTER:
+            while ((x = lseq_next(e, it->source, c)) && x->type != LVAL_ERR) {
+                lval *keep = lval_call(e, s->fn, lval_add(lval_sexpr(c), lval_copy(x)));
+                if (keep->type != LVAL_NUM) {
+                    lval_del(x);
+                    if (keep->type == LVAL_ERR) { return keep; }
+                    x = lval_err(c, "Function 'lazy-filter' predicate returned %s, Expected %s.",
+                                 ltype_name(keep->type), ltype_name(LVAL_NUM));
+                    lval_del(keep);
+                    return x;
+                }
+                long k = keep->num;
+                lval_del(keep);
+                if (k) { return x; }
+                lval_del(x);
+            }
+            return x;
+        default:
+            return NULL;
+    }
+}
+
+#define LASSERT_SEQ(func, args, index) \
+  LASSERT(args, args->cell[index]->type == LVAL_SEQ || args->cell[index]->type == LVAL_QEXPR, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s or %s.", \
+    func, index, ltype_name(args->cell[index]->type), ltype_name(LVAL_SEQ), ltype_name(LVAL_QEXPR))
+
+/* Sequence reading v, taking it, a Q-Expression is read item by item */
+lval *lval_seq_of(lval *v) {
+    if (v->type == LVAL_SEQ) { return v; }
+    lval *s = lval_seq(LSEQ_LIST, v->context);
+    s->seq->value = v;
+    return s;
+}
+
+lval *builtin_range(lenv *e, lval *a) {
+    /* Without an end the numbers go on */
+    long step = a->count > 2 ? a->cell[2]->num : 1;
+    LASSERT(a, step != 0, "Function 'range' passed step 0.");
+
+    lval *v = lval_seq(LSEQ_RANGE, a->context);
+    v->seq->from = a->cell[0]->num;
+    v->seq->to = a->count > 1 ? a->cell[1]->num : LONG_MAX;
+    v->seq->step = step;
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_iterate(lenv *e, lval *a) {
+    lval *v = lval_seq(LSEQ_ITERATE, a->context);
+    v->seq->fn = lval_pop(a, 0);
+    v->seq->value = lval_pop(a, 0);
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_repeat(lenv *e, lval *a) {
+    lval *v = lval_seq(LSEQ_REPEAT, a->context);
+    v->seq->value = lval_pop(a, 0);
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_lazy_map(lenv *e, lval *a) {
+    LASSERT_SEQ("lazy-map", a, 1);
+    long chunk = a->count > 2 ? a->cell[2]->num : 1;
+    LASSERT(a, chunk > 0 && chunk <= INT_MAX,
+            "Function 'lazy-map' passed invalid chunk size %li.", chunk);
+
+    lval *v = lval_seq(LSEQ_MAP, a->context);
+    v->seq->n = chunk;
+    v->seq->fn = lval_pop(a, 0);
+    v->seq->source = lval_seq_of(lval_pop(a, 0));
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_lazy_filter(lenv *e, lval *a) {
+    LASSERT_SEQ("lazy-filter", a, 1);
+
+    lval *v = lval_seq(LSEQ_FILTER, a->context);
+    v->seq->fn = lval_pop(a, 0);
+    v->seq->source = lval_seq_of(lval_pop(a, 0));
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_lazy_take(lenv *e, lval *a) {
+    LASSERT(a, a->cell[0]->num >= 0,
+            "Function 'lazy-take' passed invalid count %li.", a->cell[0]->num);
+    LASSERT_SEQ("lazy-take", a, 1);
+
+    lval *v = lval_seq(LSEQ_TAKE, a->context);
+    v->seq->n = a->cell[0]->num;
+    v->seq->source = lval_seq_of(lval_pop(a, 1));
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_realize(lenv *e, lval *a) {
+    LASSERT(a, !lseq_endless(a->cell[0]->seq),
+            "Function 'realize' passed a sequence that never ends.");
+
+    lval *r = lval_qexpr(a->context);
+    lseq_iter *it = lseq_iter_new(a->cell[0]->seq);
+    lval *x;
+    while ((x = lseq_next(e, it, a->context)) && x->type != LVAL_ERR) { lval_add(r, x); }
+    lseq_iter_free(it);
+    if (x) {
+        lval_del(r);
+        r = x;
+    }
+    lval_del(a);
+    return r;
+}
+
+lval *builtin_lazy_fold(lenv *e, lval *a) {
+    LASSERT_SEQ("lazy-fold", a, 2);
+    LASSERT(a, a->cell[2]->type != LVAL_SEQ || !lseq_endless(a->cell[2]->seq),
+            "Function 'lazy-fold' passed a sequence that never ends.");
+    lval *s = lval_seq_of(lval_pop(a, 2));
+
+    /* Only the accumulator and the current item are alive */
+    lval *acc = lval_pop(a, 1);
+    lseq_iter *it = lseq_iter_new(s->seq);
+    lval *x;
+    while (acc->type != LVAL_ERR && (x = lseq_next(e, it, a->context))) {
+        if (x->type == LVAL_ERR) {
+            lval_del(acc);
+            acc = x;
+            break;
+        }
+        lval *args = lval_add(lval_add(lval_sexpr(a->context), acc), x);
+        acc = lval_call(e, a->cell[0], args);
+    }
+    lseq_iter_free(it);
+    lval_del(s);
+    lval_del(a);
+    return acc;
+}
+
+lval *builtin_memo_stats(lenv *e, lval *a) {
+    LASSERT(a, a->cell[0]->memo != NULL,
+            "Function 'memo-stats' passed a function that is not memoized.");
+
+    /* Returns {hits misses size} */
+    lmemo *m = a->cell[0]->memo;
+    lval *stats = lval_qexpr(a->context);
+    pthread_mutex_lock(&m->lock);
+    lval_add(stats, lval_num(m->hits, a->context));
+    lval_add(stats, lval_num(m->misses, a->context));
+    lval_add(stats, lval_num(m->count, a->context));
+    pthread_mutex_unlock(&m->lock);
+    lval_del(a);
+    return stats;
+}
+
+lval *builtin_profile_start(lenv *e, lval *a) {
+    LASSERT_ALONE("profile-start", a);
+    LASSERT(a, a->cell[0]->num > 0 && a->cell[0]->num <= 10000,
+            "Function 'profile-start' passed invalid rate %li.", a->cell[0]->num);
+    LASSERT(a, lprof_start((int) a->cell[0]->num),
+            "Function 'profile-start' called while already profiling.");
+
+    lval *r = lval_sexpr(a->context);
+    lval_del(a);
+    return r;
+}
+
+lval *builtin_profile_stop(lenv *e, lval *a) {
+    LASSERT_ALONE("profile-stop", a);
+    LASSERT(a, lval_prof.running, "Function 'profile-stop' called while not profiling.");
+
+    /* Returns the number of samples written */
+    long samples = lprof_stop(a->cell[0]->str);
+    LASSERT(a, samples >= 0, "Could not write profile '%s': %s", a->cell[0]->str, strerror(errno));
+    lval *r = lval_num(samples, a->context);
+    lval_del(a);
+    return r;
+}
+
+int lbuiltin_is_vec(const lbuiltin_def *d) {
+    return d->vec || d->native;
+}
+
+/* Run a vector builtin over argv, deleting whatever arguments it leaves */
+lval *lbuiltin_run_vec(lenv *e, const lbuiltin_def *d, lval **argv, int argc) {
+    lval *r;
+    if (d->native) {
+        r = d->native(e->global, argv, argc, d->data);
+        if (r == NULL) { r = lval_err(NULL, "Function '%s' returned no value.", d->name); }
+    } else {
+        r = d->vec(e, argv, argc);
+    }
+    for (int i = 0; i < argc; i++) {
+        if (argv[i]) { lval_del(argv[i]); }
+    }
+    return r;
+}
+
+/* Run a builtin over an argument list whose signature is already checked */
+lval *lbuiltin_run(lenv *e, const lbuiltin_def *d, lval *a) {
+    if (!lbuiltin_is_vec(d)) { return d->fn(e, a); }
+
+    lval *r = lbuiltin_run_vec(e, d, a->cell, a->count);
+    a->count = 0;
+    lval_del(a);
+    return r;
+}
+
+/* Call a vector builtin with its arguments evaluated onto the value stack */
+lval *lval_eval_vec(lenv *e, lval *v) {
+    const lbuiltin_def *d = v->cell[0]->builtin;
+    lstack *s = &lval_stack;
+    int argc = v->count - 1;
+    int base = lstack_reserve(s, argc);
+
+    /* The argument expressions now belong to this call */
+    v->count = 1;
+    for (int i = 0; i < argc; i++) {
+        lval *x = lval_eval(e, v->cell[i + 1]);
+        if (x->type == LVAL_ERR) {
+            for (int j = 0; j < i; j++) { lval_del(s->vals[base + j]); }
+            for (int j = i + 2; j <= argc; j++) { lval_del(v->cell[j]); }
+            s->top = base;
+            lval_del(v);
+            return x;
+        }
+        s->vals[base + i] = x;
+    }
+
+    /* Nested calls are done, the stack no longer moves */
+    lval **argv = s->vals + base;
+    lval *r = lbuiltin_check(d, argv, argc, v->context);
+    if (r) {
+        for (int i = 0; i < argc; i++) { lval_del(argv[i]); }
+    } else {
+        LPROF_PUSH(frame, d->name, NULL);
+        r = lbuiltin_run_vec(e, d, argv, argc);
+        LPROF_POP(frame);
+    }
+    s->top = base;
+    lval_del(v);
+    return r;
+}
+
+lval *lval_eval_sexpr(lenv *e, lval *v) {
+
+    v->hashed = 0;
+
+    /* Evaluate the head first, special forms get the rest unevaluated */
+    if (v->count > 1) {
+        v->cell[0] = lval_eval(e, v->cell[0]);
+        if (v->cell[0]->type == LVAL_ERR) { return lval_take(v, 0); }
+        const lbuiltin_def *d = v->cell[0]->type == LVAL_FUN ? v->cell[0]->builtin : NULL;
+        if (d && d->special) {
+            lval *f = lval_pop(v, 0);
+            lval *result = lval_call(e, f, v);
+            lval_del(f);
+            return result;
+        }
+        if (d && lbuiltin_is_vec(d)) { return lval_eval_vec(e, v); }
+    }
+
+    /* Evaluate Children, an error stops evaluation of the rest */
+    for (int i = v->count > 1 ? 1 : 0; i < v->count; i++) {
+        v->cell[i] = lval_eval(e, v->cell[i]);
+        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+    }
+
+    /* Empty Expression */
+    if (v->count == 0) { return v; }
+
+    /* Single Expression */
+    if (v->count == 1) { return lval_take(v, 0); }
+
+    /* Ensure First Element is Function */
+    lval *f = lval_pop(v, 0);
+    if (f->type != LVAL_FUN) {
+        lval *err = lval_err(
+                f->context,
+                "S-Expression starts with incorrect type. "
+                "Got %s, Expected %s.",
+                ltype_name(f->type), ltype_name(LVAL_FUN));
+        lval_del(f);
+        lval_del(v);
+        return err;
+    }
+
+    lval *result = lval_call(e, f, v);
+    lval_del(f);
+    return result;
+}
+
+lval *lval_eval(lenv *e, lval *v) {
+    if (v->type == LVAL_SYM) {
+        lval *x = lenv_get(e, v);
+        lval_del(v);
+        return x;
+    }
+    if (v->type == LVAL_SEXPR) {
+        /* Tasks fail once too deep rather than overflow their stack */
+        if (lval_depth_limit && lval_depth >= lval_depth_limit) {
+            lval *err = lval_err(v->context, "Stack depth exceeded, more than %i nested evaluations in a task.",
+                                 lval_depth_limit);
+            lval_del(v);
+            return err;
+        }
+        lval_depth++;
+        lval *r = lval_eval_sexpr(e, v);
+        lval_depth--;
+        return r;
+    }
+    return v;
+}
+
+
+lval *lpartial_call(lenv *e, lval *f, lval *a) {
+    lpartial *p = f->partial;
+
+    /* Still short of arguments, extend the application */
+    if (a->count < p->remaining) {
+        return lval_partial(f, a, p->remaining - a->count);
+    }
+
+    /* Bound arguments come first, then the new ones */
+    lval *args = lval_sexpr(a->context);
+    args->cell = calloc((size_t) (p->args->count + a->count), sizeof(lval *));
+    for (int i = 0; i < p->args->count; i++) {
+        args->cell[args->count++] = lval_copy(p->args->cell[i]);
+    }
+    for (int i = 0; i < a->count; i++) {
+        args->cell[args->count++] = a->cell[i];
+    }
+    a->count = 0;
+    lval_del(a);
+
+    return lval_call(e, p->fn, args);
+}
+
+lval *lval_call(lenv *e, lval *f, lval *a) {
+
+    /* Builtins run once their arguments fit the signature */
+    if (f->builtin) {
+        lval *err = lbuiltin_check(f->builtin, a->cell, a->count, a->context);
+        if (err) {
+            lval_del(a);
+            return err;
+        }
+        LPROF_PUSH(frame, f->builtin->name, NULL);
+        lval *r = lbuiltin_run(e, f->builtin, a);
+        LPROF_POP(frame);
+        return r;
+    }
+
+    /* Memoized functions answer from their cache when they can */
+    if (f->memo) { return lmemo_call(e, f->memo, a); }
+
+    /* Partial applications add their bound arguments */
+    if (f->partial) { return lpartial_call(e, f, a); }
+
+    /* Record Argument Counts */
+    lval *formals = f->lambda->formals;
+    int given = a->count;
+    int total = formals->count;
+
+    /* Formals before '&' are required, the symbol after it takes the rest */
+    int required = total;
+    for (int i = 0; i < total; i++) {
+        if (strcmp(formals->cell[i]->sym, "&") == 0) {
+            if (i != total - 2) {
+                lval_del(a);
+                return lval_err(formals->cell[i]->context,
+                                "Function format invalid. "
+                                "Symbol '&' not followed by single symbol.");
+            }
+            required = i;
+            break;
+        }
+    }
+
+    if (required == total && given > total) {
+        lval_del(a);
+        return lval_err(f->context,
+                        "Function passed too many arguments. "
+                        "Got %i, Expected %i.", given, total);
+    }
+
+    /* Otherwise return partially applied function */
+    if (given < required) {
+        if (given == 0) {
+            lval_del(a);
+            return lval_copy(f);
+        }
+        return lval_partial(f, a, required - given);
+    }
+
+    /* Bind arguments in a fresh scope, the function itself is untouched */
+    lenv *env = lenv_new_local();
+    for (int i = 0; i < required; i++) {
+        lenv_set(env, formals->cell[i], a->cell[i]);
+    }
+    if (required != total) {
+        lval *rest = lval_qexpr(a->context);
+        rest->count = given - required;
+        rest->cell = calloc((size_t) rest->count, sizeof(lval *));
+        memcpy(rest->cell, a->cell + required, sizeof(lval *) * rest->count);
+        lenv_set(env, formals->cell[total - 1], rest);
+    }
+
+    /* Argument values now belong to the environment */
+    a->count = 0;
+    lval_del(a);
+
+    /* Set environment parent to evaluation environment */
+    lenv_set_parent(env, e);
+
+    lval *body = lval_copy(f->lambda->body);
+    body->type = LVAL_SEXPR;
+
+    /* Evaluate and return */
+    LPROF_PUSH(frame, f->name ? f->name->name : "lambda", f->context);
+    lval *result = lval_eval(env, body);
+    LPROF_POP(frame);
+    lenv_del(env);
+    return result;
+}
+
+/* Forms of a file as an S-Expression, or an error if it cannot be read */
+lval *lval_read_file(char *file, code_context *c) {
+    char *file_content = load_file(file);
+    if (file_content == NULL)
+        return lval_err(c, "Could not load '%s': Failed to load file", file);
+
+    /* Forms read before from the same unchanged file skip parsing */
+    form_cache_key key;
+    lval *expr = NULL;
+    int cacheable = form_cache_key_of(&key, file, file_content);
+    if (cacheable) { expr = form_cache_get(&key); }
+    if (expr == NULL) {
+        ast *tree = parse(file_content);
+        if (tree->type != AST_ERROR) {
+            expr = lval_read(tree);
+            if (cacheable) { form_cache_put(&key, expr); }
+        } else {
+            expr = lval_err(tree->context, "Could not load %s: \n%s", file, tree->val);
+        }
+        free_ast(tree);
+    }
+    if (cacheable) { free(key.path); }
+    free(file_content);
+    return expr;
+}
+
+/* Evaluate the forms read from file, taking them */
+lval *lval_load_forms(lenv *e, char *file, lval *expr, code_context *c) {
+    if (expr->type == LVAL_ERR) { return expr; }
+
+    /* (optimize 0) inside the file only lasts until its end */
+    lstate *s = lenv_state(e);
+    int optimize = s->optimize;
+    char *loading = s->loading;
+    s->loading = file;
+
+    /* Evaluate each Expression */
+    while (expr->count) {
+        lval *x = lval_eval(e, lval_pop(expr, 0));
+        /* If Evaluation leads to error print it */
+        if (x->type == LVAL_ERR) { lval_println(x); }
+        lval_del(x);
+    }
+
+    s->optimize = optimize;
+    s->loading = loading;
+    lval_del(expr);
+
+    return lval_sexpr(c);
+}
+
+/* The file being loaded is recorded, require looks for modules next to it */
+lval *builtin_load_file(lenv *e, char *file, code_context *c) {
+    return lval_load_forms(e, file, lval_read_file(file, c), c);
+}
+
+lval *builtin_load_file_lval(lenv *e, lval *file) {
+    LASSERT_SERIAL("load", file);
+    lval *res = builtin_load_file(e, file->cell[0]->str, file->context);
+    lval_del(file);
+    return res;
+}
+
+/* Modules loaded by require, identified by device and inode */
+typedef struct lmodule {
+    unsigned long dev;
+    unsigned long ino;
+
+    /* Result of loading, NULL while the module is still loading */
+    lval *result;
+    struct lmodule *next;
+} lmodule;
+
+/* dir/name, or dir/name.lisp when ext is set, if that is a regular file */
+char *module_try(const char *dir, size_t dir_len, const char *name, int ext,
+                 struct stat *st) {
+    size_t len = dir_len + strlen(name) + 8;
+    char *path = malloc(len);
+    if (dir_len) {
+        snprintf(path, len, "%.*s/%s%s", (int) dir_len, dir, name, ext ? ".lisp" : "");
+    } else {
+        snprintf(path, len, "%s%s", name, ext ? ".lisp" : "");
+    }
+    if (stat(path, st) == 0 && S_ISREG(st->st_mode)) { return path; }
+    free(path);
+    return NULL;
+}
+
+char *module_try_dir(const char *dir, size_t dir_len, const char *name, struct stat *st) {
+    char *path = module_try(dir, dir_len, name, 0, st);
+    if (path == NULL) { path = module_try(dir, dir_len, name, 1, st); }
+    return path;
+}
+
+/*
+ * Path of a module. Relative names are looked up next to the file being
+ * loaded (or in the working directory outside of any file), then in each
+ * directory of LISP_PATH, then next to the standard library. The .lisp
+ * extension may be left out.
+ */
+char *module_find(const char *loading, const char *name, struct stat *st) {
+    if (name[0] == '/') { return module_try_dir("", 0, name, st); }
+
+    char *path;
+    if (loading && strrchr(loading, '/')) {
+        path = module_try_dir(loading, (size_t) (strrchr(loading, '/') - loading), name, st);
+    } else {
+        path = module_try_dir("", 0, name, st);
+    }
+
+    const char *dirs = getenv("LISP_PATH");
+    while (path == NULL && dirs && *dirs) {
+        const char *end = strchr(dirs, ':');
+        size_t len = end ? (size_t) (end - dirs) : strlen(dirs);
+        if (len) { path = module_try_dir(dirs, len, name, st); }
+        dirs = end ? end + 1 : NULL;
+    }
+
+    if (path == NULL) {
+        path = module_try_dir(STD_LIB, (size_t) (strrchr(STD_LIB, '/') - STD_LIB), name, st);
+    }
+    return path;
+}
+
+lval *builtin_require(lenv *e, lval *a) {
+    LASSERT_SERIAL("require", a);
+    lstate *s = lenv_state(e);
+    struct stat st;
+    char *path = module_find(s->loading, a->cell[0]->str, &st);
+    LASSERT(a, path != NULL, "Could not find module '%s'", a->cell[0]->str);
+
+    /* Each module is loaded once, a cycle sees it as already loaded */
+    for (lmodule *m = s->modules; m; m = m->next) {
+        if (m->dev == (unsigned long) st.st_dev && m->ino == (unsigned long) st.st_ino) {
+            free(path);
+            lval *res = m->result ? lval_copy(m->result) : lval_sexpr(a->context);
+            lval_del(a);
+            return res;
+        }
+    }
+
+    lmodule *m = calloc(1, sizeof(lmodule));
+    m->dev = (unsigned long) st.st_dev;
+    m->ino = (unsigned long) st.st_ino;
+    m->next = s->modules;
+    s->modules = m;
+
+    lval *res = builtin_load_file(e, path, a->context);
+    free(path);
+    lval_del(a);
+
+    /* A module that failed to load can be required again */
+    if (res->type == LVAL_ERR) {
+        lmodule **it = &s->modules;
+        while (*it != m) { it = &(*it)->next; }
+        *it = m->next;
+        free(m);
+        return res;
+    }
+
+    m->result = lval_copy(res);
+    return res;
+}
+
+void lstate_del(lstate *s) {
+    while (s->modules) {
+        lmodule *m = s->modules;
+        s->modules = m->next;
+        if (m->result) { lval_del(m->result); }
+        free(m);
+    }
+    for (int i = 0; i < s->native_count; i++) {
+        free((char *) s->natives[i]->name);
+        free(s->natives[i]);
+    }
+    free(s->natives);
+    lsched_free(s->sched);
+    for (int i = 0; i < s->file_count; i++) {
+        if (s->files[i]) { lfile_close(s->files[i]); }
+    }
+    free(s->files);
+    free(s);
+}
+
+/*
+ * Every builtin with its signature, special forms get unevaluated
+ * arguments. Builtins either take their arguments as a list or, for the
+ * common operators, as a view of the value stack.
+ */
+const lbuiltin_def lisp_builtins[] = {
+        /* List Functions */
+        {"list",        builtin_list,            NULL,             0,  -1, ".",   0},
+        {"head",        builtin_head,            NULL,             1,  1,  "q",   0},
+        {"tail",        builtin_tail,            NULL,             1,  1,  "q",   0},
+        {"eval",        builtin_eval,            NULL,             1,  1,  "q",   0},
+        {"join",        builtin_join,            NULL,             1,  -1, "q",   0},
+
+        /* Mathematical Functions */
+        {"+",           NULL,                    builtin_add,      1,  -1, "n",   0},
+        {"-",           NULL,                    builtin_sub,      1,  -1, "n",   0},
+        {"*",           NULL,                    builtin_mul,      1,  -1, "n",   0},
+        {"/",           NULL,                    builtin_div,      1,  -1, "n",   0},
+        {"%",           NULL,                    builtin_mod,      1,  -1, "n",   0},
+
+        /* Variable Functions */
+        {"def",         builtin_def,             NULL,             1,  -1, "q.",  0},
+        {"=",           builtin_put,             NULL,             1,  -1, "q.",  0},
+
+        /* Exit REPL */
+        {"exit",        builtin_exit,            NULL,             0,  -1, ".",   0},
+
+        /* User defined functions */
+        {"lambda",      builtin_lambda,          NULL,             2,  2,  "qq",  0},
+        {"fun",         builtin_fun,             NULL,             2,  2,  "qq",  0},
+        {"apply",       builtin_apply,           NULL,             2,  2,  "fq",  0},
+        {"optimize",    builtin_optimize,        NULL,             1,  1,  "n",   0},
+        {"memo",        builtin_memo,            NULL,             1,  2,  "fn",  0},
+        {"memo-stats",  builtin_memo_stats,      NULL,             1,  1,  "f",   0},
+
+        /* Profiler Functions */
+        {"profile-start", builtin_profile_start, NULL,             1,  1,  "n",   0},
+        {"profile-stop", builtin_profile_stop,   NULL,             1,  1,  "s",   0},
+
+        /* Parallel Functions */
+        {"pmap",        builtin_pmap,            NULL,             2,  2,  "fq",  0},
+        {"pfilter",     builtin_pfilter,         NULL,             2,  2,  "fq",  0},
+        {"preduce",     builtin_preduce,         NULL,             3,  3,  "f.q", 0},
+        {"threads",     builtin_threads,         NULL,             1,  1,  "n",   0},
+
+        /* Green Threads */
+        {"spawn",       builtin_spawn,           NULL,             1,  -1, "f.",  0},
+        {"yield",       builtin_yield,           NULL,             1,  1,  ".",   0},
+        {"chan",        builtin_chan,            NULL,             1,  1,  "n",   0},
+        {"send",        builtin_send,            NULL,             2,  2,  "n.",  0},
+        {"recv",        builtin_recv,            NULL,             1,  1,  "n",   0},
+
+        /* File Functions */
+        {"open",        builtin_open,            NULL,             2,  2,  "ss",  0},
+        {"read-line",   builtin_read_line,       NULL,             1,  1,  "n",   0},
+        {"lines",       builtin_lines,           NULL,             1,  2,  "nf",  0},
+        {"read-bytes",  builtin_read_bytes,      NULL,             2,  2,  "nn",  0},
+        {"write",       builtin_write,           NULL,             2,  -1, "ns",  0},
+        {"flush",       builtin_flush,           NULL,             1,  1,  "n",   0},
+        {"close",       builtin_close,           NULL,             1,  1,  "n",   0},
+
+        /* Lazy Sequence Functions */
+        {"range",       builtin_range,           NULL,             1,  3,  "n",   0},
+        {"iterate",     builtin_iterate,         NULL,             2,  2,  "f.",  0},
+        {"repeat",      builtin_repeat,          NULL,             1,  1,  ".",   0},
+        {"lazy-map",    builtin_lazy_map,        NULL,             2,  3,  "f.n", 0},
+        {"lazy-filter", builtin_lazy_filter,     NULL,             2,  2,  "f.",  0},
+        {"lazy-take",   builtin_lazy_take,       NULL,             2,  2,  "n.",  0},
+        {"lazy-fold",   builtin_lazy_fold,       NULL,             3,  3,  "f..", 0},
+        {"realize",     builtin_realize,         NULL,             1,  1,  "l",   0},
+
+        /* Conditionals Functions */
+        {"if",          builtin_if,              NULL,             3,  3,  "nqq", 0},
+        {"==",          NULL,                    builtin_eq,       2,  2,  ".",   0},
+        {"!=",          NULL,                    builtin_ne,       2,  2,  ".",   0},
+        {"<",           NULL,                    builtin_lt,       2,  2,  "n",   0},
+        {"<=",          NULL,                    builtin_le,       2,  2,  "n",   0},
+        {">",           NULL,                    builtin_gt,       2,  2,  "n",   0},
+        {">=",          NULL,                    builtin_ge,       2,  2,  "n",   0},
+        {"||",          builtin_or,              NULL,             2,  2,  ".",   1},
+        {"&&",          builtin_and,             NULL,             2,  2,  ".",   1},
+        {"!",           NULL,                    builtin_not,      1,  1,  "n",   0},
+        {"do",          builtin_do,              NULL,             0,  -1, ".",   1},
+        {"let",         builtin_let,             NULL,             1,  1,  "q",   0},
+        {"select",      builtin_select,          NULL,             0,  -1, "q",   0},
+        {"case",        builtin_case,            NULL,             1,  -1, ".q",  0},
+        {"while",       builtin_while,           NULL,             2,  2,  "qq",  0},
+        {"dotimes",     builtin_dotimes,         NULL,             2,  2,  "qq",  0},
+        {"for-each",    builtin_for_each,        NULL,             2,  2,  "qq",  0},
+
+        /* Generic Functions */
+        {"hash-cons",   builtin_hash_cons,       NULL,             1,  1,  "n",   0},
+        {"load",        builtin_load_file_lval,  NULL,             1,  1,  "s",   0},
+        {"require",     builtin_require,         NULL,             1,  1,  "s",   0},
+        {"error",       builtin_error,           NULL,             1,  1,  "s",   0},
+        {"try",         builtin_try,             NULL,             2,  2,  "qq",  0},
+        {"catch",       builtin_catch,           NULL,             2,  2,  "qf",  0},
+        {"print",       builtin_print,           NULL,             0,  -1, ".",   0},
+
+        /* String Functions */
+        {"str-len",     NULL,                    builtin_str_len,  1,  1,  "s",   0},
+        {"substr",      builtin_substr,          NULL,             3,  3,  "snn", 0},
+        {"concat",      builtin_concat,          NULL,             0,  -1, "s",   0},
+        {"split-str",   builtin_split_str,       NULL,             2,  2,  "ss",  0},
+        {"join-str",    builtin_join_str,        NULL,             2,  2,  "sq",  0},
+        {"find",        builtin_find,            NULL,             2,  2,  "ss",  0},
+        {"replace",     builtin_replace,         NULL,             3,  3,  "sss", 0},
+        {"starts-with", builtin_starts_with,     NULL,             2,  2,  "ss",  0},
+        {"to-num",      builtin_to_num,          NULL,             1,  1,  "s",   0},
+        {"num-to-str",  builtin_num_to_str,      NULL,             1,  1,  "n",   0},
+
+        {NULL}
+};
+
+void lenv_add_builtins(lenv *e) {
+    for (const lbuiltin_def *d = lisp_builtins; d->name; d++) {
+        lval *k = lval_sym((char *) d->name, NULL);
+        lval *v = lval_func(d);
+        lenv_set(e, k, v);
+        lval_del(k);
+    }
+
+    lenv_put(e, lval_sym("true", NULL), lval_num(1, NULL));
+    lenv_put(e, lval_sym("false", NULL), lval_num(0, NULL));
+}
+
+/* Files to read and their forms, or the error reading them */
+typedef struct lread_files {
+    char **files;
+    lval **forms;
+} lread_files;
+
+void lread_files_run(ljob *job, int begin, int end) {
+    lread_files *r = job->data;
+    for (int i = begin; i < end; i++) { r->forms[i] = lval_read_file(r->files[i], NULL); }
+}
+
+void load_input_files(int argc, char **argv, lenv *e) {
+    /* first file is always standard lib*/
     argv[0] = STD_LIB;
-    /* loop over each supplied filename */
+
+    /* Read and parse every file on the pool, evaluation stays in order */
+    lread_files r = {argv, calloc((size_t) argc, sizeof(lval *))};
+    ljob job;
+    job.run = lread_files_run;
+    job.data = &r;
+    atomic_init(&job.pending, 0);
+    if (argc > 1) {
+        /* Set up before threads look for it */
+        form_cache_dir();
+        lpool_run(&job, 0, argc, 1);
+    } else {
+        lread_files_run(&job, 0, argc);
+    }
+
+    lstate *s = lenv_state(e);
     for (int i = 0; i < argc; i++) {
-        /* Pass to builtin load and get the result */
-        lval *x = builtin_load_file(e, argv[i], NULL);
+        s->library = i == 0;
+        lval *x = lval_load_forms(e, argv[i], r.forms[i], NULL);
+        s->library = 0;
         /* If the result is an error be sure to print it */
         if (x->type == LVAL_ERR) { lval_println(x); }
         lval_del(x);
     }
+    free(r.forms);
+
+    /* Tasks still ready finish before the program does */
+    lsched_drain(lenv_state(e)->sched);
 }
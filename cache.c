@@ -0,0 +1,136 @@
+#include "snapshot.c"
+
+/*
+ * Cache of the forms read from loaded files. An entry is keyed by the
+ * path of the file, its size, mtime and a hash of its contents, and is
+ * only used when all of them still match. Entries live in the directory
+ * named by LISP_CACHE, or ~/.cache/lisp, and are named after a hash of
+ * the path. Setting LISP_CACHE to an empty string turns the cache off.
+ */
+
+#define FORM_CACHE_MAGIC "LISPFRM"
+#define FORM_CACHE_VERSION 1
+
+typedef struct form_cache_header {
+    snap_header h;
+    unsigned long size;
+    long mtime;
+    unsigned long hash;
+} form_cache_header;
+
+typedef struct form_cache_key {
+    char *path;
+    unsigned long size;
+    long mtime;
+    unsigned long hash;
+} form_cache_key;
+
+/* Directory holding the entries, created on first use, NULL if disabled */
+char *form_cache_dir(void) {
+    static char dir[4096];
+    static int state = 0;
+    if (state) { return state > 0 ? dir : NULL; }
+
+    state = -1;
+    const char *env = getenv("LISP_CACHE");
+    if (env) {
+        if (!*env || strlen(env) >= sizeof(dir)) { return NULL; }
+        strcpy(dir, env);
+    } else {
+        const char *home = getenv("HOME");
+        if (!home || strlen(home) + 16 >= sizeof(dir)) { return NULL; }
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+        mkdir(dir, 0755);
+        strcat(dir, "/lisp");
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) { return NULL; }
+
+    state = 1;
+    return dir;
+}
+
+/* Fill in the key of file, 0 if the file cannot be used */
+int form_cache_key_of(form_cache_key *k, const char *file, const char *content) {
+    struct stat st;
+    if (stat(file, &st) != 0) { return 0; }
+
+    /* Relative paths are keyed from the working directory */
+    char cwd[4096];
+    if (file[0] != '/' && getcwd(cwd, sizeof(cwd))) {
+        size_t len = strlen(cwd) + strlen(file) + 2;
+        k->path = malloc(len);
+        snprintf(k->path, len, "%s/%s", cwd, file);
+    } else {
+        k->path = str_dup(file);
+    }
+    k->size = (unsigned long) st.st_size;
+    k->mtime = (long) st.st_mtime;
+    k->hash = lval_hash_bytes(LVAL_HASH_SEED, content, strlen(content));
+    return 1;
+}
+
+char *form_cache_entry(form_cache_key *k) {
+    char *dir = form_cache_dir();
+    if (dir == NULL) { return NULL; }
+
+    size_t len = strlen(dir) + 32;
+    char *entry = malloc(len);
+    snprintf(entry, len, "%s/%016lx.forms",
+             dir, lval_hash_bytes(LVAL_HASH_SEED, k->path, strlen(k->path)));
+    return entry;
+}
+
+/* Forms cached for the key, NULL when there is no valid entry */
+lval *form_cache_get(form_cache_key *k) {
+    char *entry = form_cache_entry(k);
+    if (entry == NULL) { return NULL; }
+
+    size_t size;
+    char *data = snap_map(entry, &size);
+    free(entry);
+    if (data == NULL) { return NULL; }
+
+    lval *forms = NULL;
+    snap_reader r;
+    form_cache_header h;
+    size_t path_len = strlen(k->path);
+    if (snap_reader_open(&r, data, size, FORM_CACHE_MAGIC, FORM_CACHE_VERSION, sizeof(h))) {
+        memcpy(&h, data, sizeof(h));
+        size_t len;
+        const char *path = snap_get_text(&r, &len);
+        if (r.ok && h.size == k->size && h.mtime == k->mtime && h.hash == k->hash &&
+            len == path_len && memcmp(path, k->path, len) == 0) {
+            forms = snap_read(&r, 0);
+            if (!r.ok || forms->type != LVAL_SEXPR) {
+                lval_del(forms);
+                forms = NULL;
+            }
+        }
+    }
+    snap_reader_close(&r);
+    munmap(data, size);
+    return forms;
+}
+
+/* Store the forms read for the key, failures only cost the next load */
+void form_cache_put(form_cache_key *k, lval *forms) {
+    char *entry = form_cache_entry(k);
+    if (entry == NULL) { return; }
+
+    snap_writer w;
+    memset(&w, 0, sizeof(w));
+    snap_text(&w.values, k->path, strlen(k->path));
+    snap_write(&w, forms);
+
+    form_cache_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.h.magic, FORM_CACHE_MAGIC, sizeof(FORM_CACHE_MAGIC));
+    h.h.version = FORM_CACHE_VERSION;
+    h.size = k->size;
+    h.mtime = k->mtime;
+    h.hash = k->hash;
+
+    snap_write_file(entry, &h.h, sizeof(h), &w);
+    snap_writer_free(&w);
+    free(entry);
+}
@@ -1,3 +1,17 @@
+#include <stdatomic.h>
+
+/* Reference counts, updated atomically as values are shared between threads */
+typedef atomic_int lrefs;
+
+void lref_inc(lrefs *r) {
+    atomic_fetch_add_explicit(r, 1, memory_order_relaxed);
+}
+
+/* Drop a reference, returns how many are left */
+int lref_dec(lrefs *r) {
+    return atomic_fetch_sub_explicit(r, 1, memory_order_acq_rel) - 1;
+}
+
 int exists(const char *val, const char *arr) {
     for (int i = 0; arr[i] != '\0'; i++) {
         if (arr[i] == *val)
@@ -31,7 +45,8 @@ char *load_file(const char *name) {
     fseek(infile, 0L, SEEK_END);
     size = ftell(infile);
     fseek(infile, 0L, SEEK_SET);
-    buffer = (char *) calloc((size_t) size, sizeof(char));
+    /* One extra byte keeps the buffer NUL terminated for the tokenizer */
+    buffer = (char *) calloc((size_t) size + 1, sizeof(char));
 
     if (buffer == NULL)
         return NULL;
@@ -41,4 +56,20 @@ char *load_file(const char *name) {
     fclose(infile);
 
     return buffer;
-}
\ No newline at end of file
+}
+
+const char *str_find(const char *hay, size_t hay_len,
+                     const char *needle, size_t needle_len) {
+    if (needle_len == 0) { return hay; }
+    if (needle_len > hay_len) { return NULL; }
+
+    /* Scan for the first byte with memchr, then confirm the rest */
+    const char *end = hay + hay_len - needle_len + 1;
+    while (hay < end) {
+        hay = memchr(hay, needle[0], (size_t) (end - hay));
+        if (hay == NULL) { return NULL; }
+        if (memcmp(hay, needle, needle_len) == 0) { return hay; }
+        hay++;
+    }
+    return NULL;
+}
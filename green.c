@@ -0,0 +1,381 @@
+#include <ucontext.h>
+#include "pool.c"
+
+/*
+ * The value stack of a thread holds the evaluated arguments of vector
+ * builtin calls in progress. It only grows, so calls reuse the same slots.
+ * Green threads each have their own, swapped in when they run.
+ */
+typedef struct lstack {
+    lval **vals;
+    int top;
+    int size;
+} lstack;
+
+_Thread_local lstack lval_stack;
+
+void lstack_free(void) {
+    free(lval_stack.vals);
+    memset(&lval_stack, 0, sizeof(lstack));
+}
+
+int lstack_reserve(lstack *s, int n) {
+    if (s->top + n > s->size) {
+        while (s->top + n > s->size) {
+            s->size = s->size ? s->size * 2 : 256;
+        }
+        s->vals = realloc(s->vals, sizeof(lval *) * (size_t) s->size);
+    }
+    int base = s->top;
+    s->top += n;
+    return base;
+}
+
+/*
+ * Green threads of an interpreter, run one at a time on the thread using
+ * it. A task evaluates on a stack of its own, mapped without reserving
+ * memory so only the pages it touches are used, and runs until it yields
+ * or waits on a channel. Ready tasks then continue in the order they
+ * became ready. The code outside of the tasks is the root task and can
+ * wait on channels as well.
+ *
+ * Channels are numbered per interpreter and pass values in order. A send
+ * waits while the channel is full, for capacity 0 until a receiver takes
+ * the value. When every task waits, the root's wait fails.
+ */
+
+#define LTASK_STACK_SIZE (8 * 1024 * 1024)
+#define LTASK_SPARE_STACKS 64
+
+/* Nested evaluations a task may reach, failing well before its guard page */
+#define LTASK_MAX_DEPTH 10000
+
+/* Nested evaluations of the running task and its limit, 0 outside of tasks */
+_Thread_local int lval_depth = 0;
+_Thread_local int lval_depth_limit = 0;
+
+lval *lval_call(lenv *e, lval *f, lval *a);
+
+typedef struct ltask {
+    int id;
+    ucontext_t context;
+
+    /* Mapped stack with a guard page below it, NULL for the root */
+    char *stack;
+    lstack values;
+    lprof_frame *frames;
+    int depth;
+
+    /* Function and arguments, until the task starts */
+    lenv *e;
+    lval *fn;
+    lval *args;
+
+    /* Value handed over by a channel, and whether the wait failed */
+    lval *value;
+    int failed;
+
+    /* Queue the task is waiting in, and the next task in it or ready */
+    struct ltask_queue *waiting;
+    struct ltask *next;
+
+    /* Every task of the interpreter, for freeing them with it */
+    struct ltask *next_all;
+    struct ltask *prev_all;
+} ltask;
+
+typedef struct ltask_queue {
+    ltask *head;
+    ltask *tail;
+} ltask_queue;
+
+typedef struct lchan {
+    int capacity;
+
+    /* Buffered values, a ring of capacity slots */
+    lval **items;
+    int head;
+    int count;
+
+    ltask_queue senders;
+    ltask_queue receivers;
+} lchan;
+
+typedef struct lsched {
+    ltask root;
+    ltask *current;
+    ltask_queue ready;
+    ltask *all;
+    int next_id;
+
+    lchan **chans;
+    int chan_count;
+
+    /* Finished task, released once off its stack */
+    ltask *done;
+    char *spare[LTASK_SPARE_STACKS];
+    int spare_count;
+} lsched;
+
+/* Scheduler of the task being started on this thread */
+_Thread_local lsched *lsched_self = NULL;
+
+void ltask_push(ltask_queue *q, ltask *t) {
+    t->next = NULL;
+    if (q->tail) { q->tail->next = t; } else { q->head = t; }
+    q->tail = t;
+}
+
+ltask *ltask_pop(ltask_queue *q) {
+    ltask *t = q->head;
+    if (t) {
+        q->head = t->next;
+        if (q->head == NULL) { q->tail = NULL; }
+        t->next = NULL;
+    }
+    return t;
+}
+
+void ltask_remove(ltask_queue *q, ltask *t) {
+    ltask *prev = NULL;
+    for (ltask *i = q->head; i; prev = i, i = i->next) {
+        if (i != t) { continue; }
+        if (prev) { prev->next = t->next; } else { q->head = t->next; }
+        if (q->tail == t) { q->tail = prev; }
+        t->next = NULL;
+        return;
+    }
+}
+
+lsched *lsched_new(void) {
+    lsched *s = calloc(1, sizeof(lsched));
+    s->current = &s->root;
+    return s;
+}
+
+size_t lsched_page(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    return page > 0 ? (size_t) page : 4096;
+}
+
+void lsched_unmap(lsched *s, char *stack) {
+    if (s->spare_count < LTASK_SPARE_STACKS) {
+        /* Pages a deep task touched are given back before reuse */
+        size_t page = lsched_page();
+        madvise(stack + page, LTASK_STACK_SIZE - page, MADV_DONTNEED);
+        s->spare[s->spare_count++] = stack;
+    } else {
+        munmap(stack, LTASK_STACK_SIZE);
+    }
+}
+
+/* Free a task that is not running, its stack may no longer be in use */
+void ltask_free(lsched *s, ltask *t) {
+    if (t->prev_all) { t->prev_all->next_all = t->next_all; } else { s->all = t->next_all; }
+    if (t->next_all) { t->next_all->prev_all = t->prev_all; }
+    if (t->fn) { lval_del(t->fn); }
+    if (t->args) { lval_del(t->args); }
+    if (t->value) { lval_del(t->value); }
+    free(t->values.vals);
+    lsched_unmap(s, t->stack);
+    free(t);
+}
+
+/* Release the task that finished before switching here */
+void lsched_release(lsched *s) {
+    if (s->done) {
+        ltask_free(s, s->done);
+        s->done = NULL;
+    }
+}
+
+void lsched_switch(lsched *s, ltask *next) {
+    ltask *prev = s->current;
+    prev->values = lval_stack;
+    lval_stack = next->values;
+    prev->frames = lprof_top;
+    lprof_top = next->frames;
+    prev->depth = lval_depth;
+    lval_depth = next->depth;
+    lval_depth_limit = next->stack ? LTASK_MAX_DEPTH : 0;
+    s->current = next;
+    lsched_self = s;
+    swapcontext(&prev->context, &next->context);
+    lsched_release(s);
+}
+
+/* Fail the wait of the root, the only task that can go on once all wait */
+ltask *lsched_deadlock(lsched *s) {
+    ltask *root = &s->root;
+    if (root->waiting) {
+        ltask_remove(root->waiting, root);
+        root->waiting = NULL;
+    }
+    root->failed = 1;
+    return root;
+}
+
+void ltask_main(void) {
+    lsched *s = lsched_self;
+    lsched_release(s);
+
+    ltask *t = s->current;
+    lval *fn = t->fn;
+    lval *args = t->args;
+    t->fn = NULL;
+    t->args = NULL;
+
+    lval *r = lval_call(t->e, fn, args);
+    if (r->type == LVAL_ERR) { lval_println(r); }
+    lval_del(r);
+    lval_del(fn);
+
+    /* Never resumed, the next task frees it */
+    s->done = t;
+    ltask *next = ltask_pop(&s->ready);
+    lsched_switch(s, next ? next : lsched_deadlock(s));
+}
+
+/* Task calling fn with args in e, taking both, 0 if no stack could be mapped */
+int lsched_spawn(lsched *s, lenv *e, lval *fn, lval *args) {
+    size_t page = lsched_page();
+    char *stack;
+    if (s->spare_count) {
+        stack = s->spare[--s->spare_count];
+    } else {
+        stack = mmap(NULL, LTASK_STACK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (stack == MAP_FAILED) { return 0; }
+        mprotect(stack, page, PROT_NONE);
+    }
+
+    ltask *t = calloc(1, sizeof(ltask));
+    t->id = ++s->next_id;
+    t->stack = stack;
+    t->e = e;
+    t->fn = fn;
+    t->args = args;
+    getcontext(&t->context);
+    t->context.uc_stack.ss_sp = stack + page;
+    t->context.uc_stack.ss_size = LTASK_STACK_SIZE - page;
+    t->context.uc_link = NULL;
+    makecontext(&t->context, ltask_main, 0);
+
+    t->next_all = s->all;
+    if (s->all) { s->all->prev_all = t; }
+    s->all = t;
+    ltask_push(&s->ready, t);
+    return t->id;
+}
+
+/* Let the ready tasks run before the current one goes on */
+void lsched_yield(lsched *s) {
+    ltask *next = ltask_pop(&s->ready);
+    if (next == NULL) { return; }
+    ltask_push(&s->ready, s->current);
+    lsched_switch(s, next);
+}
+
+/* Run until no task is ready, as at the end of a program */
+void lsched_drain(lsched *s) {
+    while (s && s->current == &s->root && s->ready.head) { lsched_yield(s); }
+}
+
+/* Wait in q until woken, 0 if every other task is waiting too */
+int lsched_wait(lsched *s, ltask_queue *q) {
+    ltask *next = ltask_pop(&s->ready);
+    if (next == NULL) { return 0; }
+    ltask *t = s->current;
+    t->waiting = q;
+    ltask_push(q, t);
+    lsched_switch(s, next);
+
+    int ok = !t->failed;
+    t->failed = 0;
+    return ok;
+}
+
+void lsched_wake(lsched *s, ltask *t) {
+    t->waiting = NULL;
+    ltask_push(&s->ready, t);
+}
+
+/* New channel holding up to capacity values, returns its number */
+int lsched_chan(lsched *s, int capacity) {
+    lchan *c = calloc(1, sizeof(lchan));
+    c->capacity = capacity;
+    c->items = capacity ? calloc((size_t) capacity, sizeof(lval *)) : NULL;
+    s->chans = realloc(s->chans, sizeof(lchan *) * (size_t) (s->chan_count + 1));
+    s->chans[s->chan_count++] = c;
+    return s->chan_count;
+}
+
+lchan *lsched_chan_get(lsched *s, long id) {
+    if (s == NULL || id < 1 || id > s->chan_count) { return NULL; }
+    return s->chans[id - 1];
+}
+
+/* Send v, taking it, 0 if the send could never complete */
+int lsched_send(lsched *s, lchan *c, lval *v) {
+    ltask *r = ltask_pop(&c->receivers);
+    if (r) {
+        r->value = v;
+        lsched_wake(s, r);
+        return 1;
+    }
+    if (c->count < c->capacity) {
+        c->items[(c->head + c->count++) % c->capacity] = v;
+        return 1;
+    }
+
+    ltask *t = s->current;
+    t->value = v;
+    if (lsched_wait(s, &c->senders)) { return 1; }
+    lval_del(t->value);
+    t->value = NULL;
+    return 0;
+}
+
+/* Next value of c, NULL if it could never arrive */
+lval *lsched_recv(lsched *s, lchan *c) {
+    lval *v = NULL;
+    ltask *w = ltask_pop(&c->senders);
+    if (c->count) {
+        v = c->items[c->head];
+        c->head = (c->head + 1) % c->capacity;
+        c->count--;
+        /* A waiting sender takes the freed slot */
+        if (w) {
+            c->items[(c->head + c->count++) % c->capacity] = w->value;
+        }
+    } else if (w) {
+        v = w->value;
+    } else {
+        if (!lsched_wait(s, &c->receivers)) { return NULL; }
+        v = s->current->value;
+        s->current->value = NULL;
+        return v;
+    }
+
+    if (w) {
+        w->value = NULL;
+        lsched_wake(s, w);
+    }
+    return v;
+}
+
+/* Free the scheduler of an interpreter, tasks that never finished are dropped */
+void lsched_free(lsched *s) {
+    if (s == NULL) { return; }
+    lsched_release(s);
+    while (s->all) { ltask_free(s, s->all); }
+    for (int i = 0; i < s->chan_count; i++) {
+        lchan *c = s->chans[i];
+        for (int j = 0; j < c->count; j++) { lval_del(c->items[(c->head + j) % c->capacity]); }
+        free(c->items);
+        free(c);
+    }
+    free(s->chans);
+    for (int i = 0; i < s->spare_count; i++) { munmap(s->spare[i], LTASK_STACK_SIZE); }
+    free(s);
+}
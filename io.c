@@ -0,0 +1,176 @@
+#include "green.c"
+
+/*
+ * Files opened by scripts. A regular file opened for reading is mapped
+ * whole and lines are cut straight out of the mapping, other files are
+ * read through a buffer that grows to hold the longest line. Pages of a
+ * mapping that have been read are given back as reading moves on, so
+ * scanning a file takes constant memory whatever its size.
+ * Writes collect in a buffer flushed when it fills, on flush and on close.
+ */
+
+#define LFILE_BUFFER (64 * 1024)
+#define LFILE_DROP (16 * 1024 * 1024)
+
+typedef struct lfile {
+    int fd;
+    int writing;
+
+    /* Bytes to read are data[pos, end), the mapping or the buffer */
+    char *data;
+    size_t pos;
+    size_t end;
+    size_t size;
+    int mapped;
+    int eof;
+
+    /* Mapped bytes before this have been given back */
+    size_t dropped;
+} lfile;
+
+/* Open path with mode "r", "w" or "a", NULL with errno set on failure */
+lfile *lfile_open(const char *path, const char *mode) {
+    int flags;
+    if (strcmp(mode, "r") == 0) {
+        flags = O_RDONLY;
+    } else if (strcmp(mode, "w") == 0) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (strcmp(mode, "a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd = open(path, flags, 0666);
+    if (fd < 0) { return NULL; }
+
+    lfile *f = calloc(1, sizeof(lfile));
+    f->fd = fd;
+    f->writing = flags != O_RDONLY;
+    if (f->writing) {
+        f->size = LFILE_BUFFER;
+        f->data = malloc(f->size);
+        return f;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+            f->data = map;
+            f->end = f->size = (size_t) st.st_size;
+            f->mapped = 1;
+            f->eof = 1;
+            return f;
+        }
+    }
+    f->eof = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 0;
+    return f;
+}
+
+/* Read more into the buffer after what is left, 0 at the end of the file */
+int lfile_fill(lfile *f) {
+    if (f->eof) { return 0; }
+    if (f->pos) {
+        memmove(f->data, f->data + f->pos, f->end - f->pos);
+        f->end -= f->pos;
+        f->pos = 0;
+    }
+    if (f->end == f->size) {
+        f->size = f->size ? f->size * 2 : LFILE_BUFFER;
+        f->data = realloc(f->data, f->size);
+    }
+    while (1) {
+        ssize_t n = read(f->fd, f->data + f->end, f->size - f->end);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) {
+            f->eof = 1;
+            return 0;
+        }
+        f->end += (size_t) n;
+        return 1;
+    }
+}
+
+/* Give back the mapped pages already read */
+void lfile_drop(lfile *f) {
+    if (!f->mapped || f->pos - f->dropped < LFILE_DROP) { return; }
+    size_t page = lsched_page();
+    size_t upto = f->pos / page * page;
+    madvise(f->data + f->dropped, upto - f->dropped, MADV_DONTNEED);
+    f->dropped = upto;
+}
+
+/* Next line without its line ending, valid until the next read, 0 at the end */
+int lfile_line(lfile *f, const char **line, size_t *len) {
+    size_t from = f->pos;
+    char *nl = NULL;
+    while (from == f->end || (nl = memchr(f->data + from, '\n', f->end - from)) == NULL) {
+        size_t scanned = f->end - f->pos;
+        if (!lfile_fill(f)) { break; }
+        from = f->pos + scanned;
+    }
+    if (nl == NULL && f->pos == f->end) { return 0; }
+
+    /* A last line may end without a newline, one ending in \r\n loses both */
+    size_t stop = nl ? (size_t) (nl - f->data) : f->end;
+    *line = f->data + f->pos;
+    *len = stop - f->pos;
+    if (nl && *len && (*line)[*len - 1] == '\r') { (*len)--; }
+    f->pos = nl ? stop + 1 : stop;
+    lfile_drop(f);
+    return 1;
+}
+
+/* Up to n bytes, valid until the next read, 0 at the end */
+size_t lfile_bytes(lfile *f, size_t n, const char **bytes) {
+    while (f->end - f->pos < n && lfile_fill(f)) {}
+    size_t len = f->end - f->pos < n ? f->end - f->pos : n;
+    if (len == 0) { return 0; }
+    *bytes = f->data + f->pos;
+    f->pos += len;
+    lfile_drop(f);
+    return len;
+}
+
+int lfile_write_all(int fd, const char *s, size_t n) {
+    while (n) {
+        ssize_t w = write(fd, s, n);
+        if (w < 0 && errno == EINTR) { continue; }
+        if (w <= 0) { return 0; }
+        s += w;
+        n -= (size_t) w;
+    }
+    return 1;
+}
+
+int lfile_flush(lfile *f) {
+    if (!f->writing || f->end == 0) { return 1; }
+    int ok = lfile_write_all(f->fd, f->data, f->end);
+    f->end = 0;
+    return ok;
+}
+
+/* Buffer n bytes of s, writing straight through what would not fit */
+int lfile_write(lfile *f, const char *s, size_t n) {
+    if (f->end + n > f->size && !lfile_flush(f)) { return 0; }
+    if (n >= f->size) { return lfile_write_all(f->fd, s, n); }
+    memcpy(f->data + f->end, s, n);
+    f->end += n;
+    return 1;
+}
+
+/* Flush and close f, 0 if pending writes failed */
+int lfile_close(lfile *f) {
+    int ok = lfile_flush(f);
+    if (close(f->fd) != 0) { ok = 0; }
+    if (f->mapped) {
+        munmap(f->data, f->size);
+    } else {
+        free(f->data);
+    }
+    free(f);
+    return ok;
+}
@@ -0,0 +1,86 @@
+#include "batch.c"
+
+/*
+ * Runs independent scripts on several threads of one process. The
+ * standard library is loaded once into an environment that is then
+ * frozen, and each script gets a global environment of its own on top
+ * of it. Definitions of a script stay in its own environment.
+ * Output of each script is buffered and written once every script
+ * before it has finished, so it appears in the order the files were given.
+ */
+
+typedef struct ljobs {
+    lenv *base;
+    char **files;
+    int count;
+
+    /* Next script to be picked up by a thread */
+    atomic_int next;
+
+    /* Output of each script, written out once done */
+    lbuf *outputs;
+    int *done;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+} ljobs;
+
+void jobs_run_one(ljobs *j, int i) {
+    lenv *e = lenv_new_shared(j->base);
+    lval_out = &j->outputs[i];
+    lval *x = builtin_load_file(e, j->files[i], NULL);
+    if (x->type == LVAL_ERR) { lval_println(x); }
+    lval_del(x);
+    lsched_drain(lenv_state(e)->sched);
+    lval_out = NULL;
+    lenv_del(e);
+
+    pthread_mutex_lock(&j->lock);
+    j->done[i] = 1;
+    pthread_cond_broadcast(&j->finished);
+    pthread_mutex_unlock(&j->lock);
+}
+
+void *jobs_worker(void *arg) {
+    ljobs *j = arg;
+    int i;
+    while ((i = atomic_fetch_add(&j->next, 1)) < j->count) { jobs_run_one(j, i); }
+    lstack_free();
+    return NULL;
+}
+
+/* Run count files on up to threads threads, each in an interpreter sharing base */
+void jobs_run(lenv *base, char **files, int count, int threads) {
+    ljobs j = {.base = base, .files = files, .count = count};
+    atomic_init(&j.next, 0);
+    j.outputs = calloc((size_t) count, sizeof(lbuf));
+    j.done = calloc((size_t) count, sizeof(int));
+    pthread_mutex_init(&j.lock, NULL);
+    pthread_cond_init(&j.finished, NULL);
+
+    lenv_freeze(base);
+    fflush(stdout);
+
+    if (threads > count) { threads = count; }
+    pthread_t *workers = calloc((size_t) threads, sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, jobs_worker, &j);
+    }
+
+    /* Write each output in order as soon as it is complete */
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_lock(&j.lock);
+        while (!j.done[i]) { pthread_cond_wait(&j.finished, &j.lock); }
+        pthread_mutex_unlock(&j.lock);
+
+        fwrite(j.outputs[i].data, 1, j.outputs[i].len, stdout);
+        fflush(stdout);
+        free(j.outputs[i].data);
+    }
+
+    for (int i = 0; i < threads; i++) { pthread_join(workers[i], NULL); }
+    free(workers);
+    pthread_mutex_destroy(&j.lock);
+    pthread_cond_destroy(&j.finished);
+    free(j.outputs);
+    free(j.done);
+}
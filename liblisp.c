@@ -0,0 +1,141 @@
+#define _DEFAULT_SOURCE
+#include "builtins.c"
+#include "lisp.h"
+
+/*
+ * liblisp, the interpreter behind the API in lisp.h. Built as its own
+ * translation unit, the lisp executable still includes builtins.c directly.
+ */
+
+/* Evaluate the forms in order, stopping at the first error */
+lval *lisp_run(lenv *e, lval *forms, char *file) {
+    lstate *s = lenv_state(e);
+    int optimize = s->optimize;
+    char *loading = s->loading;
+    if (file) { s->loading = file; }
+
+    lval *x = lval_sexpr(NULL);
+    while (forms->count) {
+        lval_del(x);
+        x = lval_eval(e, lval_pop(forms, 0));
+        if (x->type == LVAL_ERR) { break; }
+    }
+    lsched_drain(s->sched);
+
+    s->optimize = optimize;
+    s->loading = loading;
+    lval_del(forms);
+    return x;
+}
+
+lisp_interp *lisp_new(void) {
+    lenv *e = lenv_new();
+    lenv_add_builtins(e);
+    return e;
+}
+
+lisp_value *lisp_load_stdlib(lisp_interp *l, const char *file) {
+    /* Its lambdas are marked so the optimizer may inline them */
+    lstate *s = lenv_state(l);
+    s->library = 1;
+    lisp_value *v = lisp_eval_file(l, file ? file : STD_LIB);
+    s->library = 0;
+    return v;
+}
+
+void lisp_free(lisp_interp *l) {
+    lenv_del(l);
+}
+
+lisp_value *lisp_eval_string(lisp_interp *l, const char *source) {
+    ast *tree = parse((char *) source);
+    lval *forms;
+    if (tree->type != AST_ERROR) {
+        forms = lval_read(tree);
+    } else {
+        forms = lval_err(tree->context, "%s", tree->val);
+    }
+    free_ast(tree);
+
+    if (forms->type == LVAL_ERR) { return forms; }
+    return lisp_run(l, forms, NULL);
+}
+
+lisp_value *lisp_eval_file(lisp_interp *l, const char *file) {
+    lval *forms = lval_read_file((char *) file, NULL);
+    if (forms->type == LVAL_ERR) { return forms; }
+    return lisp_run(l, forms, (char *) file);
+}
+
+void lisp_define(lisp_interp *l, const char *name, lisp_native fn,
+                 int min, int max, void *data) {
+    lbuiltin_def *d = calloc(1, sizeof(lbuiltin_def));
+    d->name = str_dup(name);
+    d->min = min;
+    d->max = max;
+    d->types = ".";
+    d->native = fn;
+    d->data = data;
+
+    /* Definitions live as long as the interpreter, copies may still use them */
+    lstate *s = lenv_state(l);
+    s->natives = realloc(s->natives, sizeof(lbuiltin_def *) * (s->native_count + 1));
+    s->natives[s->native_count++] = d;
+
+    lval *k = lval_sym((char *) name, NULL);
+    lenv_set(l, k, lval_func(d));
+    lval_del(k);
+}
+
+int lisp_type(const lisp_value *v) {
+    return v->type;
+}
+
+long lisp_number(const lisp_value *v) {
+    return v->type == LVAL_NUM ? v->num : 0;
+}
+
+const char *lisp_string(lisp_value *v, size_t *len) {
+    const char *s;
+    switch (v->type) {
+        case LVAL_STR: s = v->str; break;
+        case LVAL_SYM: s = v->sym; break;
+        case LVAL_ERR: s = lval_err_msg(v); break;
+        default: return NULL;
+    }
+    if (len) { *len = v->len; }
+    return s;
+}
+
+int lisp_count(const lisp_value *v) {
+    return v->type == LVAL_SEXPR || v->type == LVAL_QEXPR ? v->count : 0;
+}
+
+lisp_value *lisp_item(const lisp_value *v, int i) {
+    if (i < 0 || i >= lisp_count(v)) { return NULL; }
+    return v->cell[i];
+}
+
+lisp_value *lisp_make_number(long n) {
+    return lval_num(n, NULL);
+}
+
+lisp_value *lisp_make_string(const char *s, size_t len) {
+    return lval_str_n(s, len, NULL);
+}
+
+lisp_value *lisp_make_error(const char *message) {
+    return lval_err(NULL, "%s", message);
+}
+
+lisp_value *lisp_make_list(void) {
+    return lval_qexpr(NULL);
+}
+
+lisp_value *lisp_list_add(lisp_value *list, lisp_value *item) {
+    return lval_add(list, item);
+}
+
+void lisp_value_free(lisp_value *v) {
+    lval_del(v);
+}
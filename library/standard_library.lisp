@@ -4,9 +4,7 @@
 (def {false} 0)
 
 ; Call function with given list of args
-(fun {unpack f l} {
-	eval(join (list f) l)
-})
+(def {unpack} apply)
 
 ; Call function with single list created from args
 (fun {pack f & args} {
@@ -17,20 +15,12 @@
 (def {curry} unpack)
 (def {uncurry} pack)
 
-; Perform no of actions in sequence
-(fun {do & l} {
-	if (== l nil) {nil} {last l}
-})
-
-; Create a local scope
-(fun {let body} {
-	((lambda {_} body) ())
-})
+; do and let are native, see builtin_do and builtin_let
 
-; Logical Functions
-(fun {not x}   {- 1 x})
-(fun {or x y}  {+ x y})
-(fun {and x y} {* x y})
+; Logical Functions, short circuiting
+(def {not} !)
+(def {or} ||)
+(def {and} &&)
 
 ; Flip arguments for currying
 (fun {flip f a b} {f b a})
@@ -105,20 +95,7 @@
     {foldl f (f z (fst l)) (tail l)}
 })
 
-; switch statement, takes zero or more (cond, body) pairs
-(fun {select & cs} {
-  if (== cs nil)
-    {error "No Selection Found"}
-    {if (fst (fst cs)) {snd (fst cs)} {unpack select (tail cs)}}
-})
+; select and case are native, see builtin_select and builtin_case
 
 ; Default Case
 (def {otherwise} true)
-
-; C style case statements
-(fun {case x & cs} {
-  if (== cs nil)
-    {error "No Case Found"}
-    {if (== x (fst (fst cs))) {snd (fst cs)} {
-      unpack case (join (list x) (tail cs))}}
-})
@@ -1,5 +1,5 @@
 
-#include "builtins.c"
+#include "jobs.c"
 
 void repl(lenv *e) {
     puts("Lisp version 0.2.0");
@@ -14,6 +14,7 @@ void repl(lenv *e) {
         ast *tree = parse(input);
         if (tree->type != AST_ERROR) {
             lval *x = lval_eval(e, lval_read(tree));
+            lsched_drain(lenv_state(e)->sched);
             lval_println(x);
             lval_del(x);
         } else {
@@ -30,6 +31,85 @@ void repl(lenv *e) {
 
 int main(int argc, char **argv) {
     lenv *global_env = lenv_new();
+
+    /* lisp --save-image image [prelude...] */
+    if (argc >= 3 && strcmp(argv[1], "--save-image") == 0) {
+        lenv_add_builtins(global_env);
+        char *image = argv[2];
+        load_input_files(argc - 2, argv + 2, global_env);
+
+        lval *x = snapshot_save(global_env, image);
+        int failed = x->type == LVAL_ERR;
+        if (failed) { lval_println(x); }
+        lval_del(x);
+        return failed;
+    }
+
+    /* lisp --image image [file...] starts from a saved environment */
+    if (argc >= 3 && strcmp(argv[1], "--image") == 0) {
+        lval *x = snapshot_load(global_env, argv[2]);
+        if (x->type == LVAL_ERR) {
+            lval_println(x);
+            lval_del(x);
+            return 1;
+        }
+        lval_del(x);
+
+        for (int i = 3; i < argc; i++) {
+            x = builtin_load_file(global_env, argv[i], NULL);
+            if (x->type == LVAL_ERR) { lval_println(x); }
+            lval_del(x);
+        }
+        lsched_drain(lenv_state(global_env)->sched);
+
+        if (argc == 3)
+            repl(global_env);
+        return 0;
+    }
+
+    /* lisp --profile out [file...] samples the whole run, written to out at exit */
+    if (argc >= 3 && strcmp(argv[1], "--profile") == 0) {
+        lprof_file = argv[2];
+        lprof_start(LPROF_HZ);
+        atexit(lprof_at_exit);
+        lenv_add_builtins(global_env);
+        load_input_files(argc - 2, argv + 2, global_env);
+
+        if (argc == 3)
+            repl(global_env);
+        return 0;
+    }
+
+    /* lisp --batch [--socket path [--workers n ...]] [file...] answers requests */
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+        batch_options o;
+        int skip = batch_options_parse(&o, argc, argv);
+        if (skip < 0) {
+            fputs("Usage: lisp --batch [--socket path [--workers n] [--max-requests n] "
+                  "[--max-growth mb]] [file...]\n", stderr);
+            return 1;
+        }
+        lenv_add_builtins(global_env);
+        load_input_files(argc - skip, argv + skip, global_env);
+
+        if (o.socket) { return batch_listen(global_env, &o); }
+        batch_serve(global_env, 0, 1, NULL);
+        return 0;
+    }
+
+    /* lisp --jobs n file... runs the files concurrently over one standard library */
+    if (argc >= 2 && strcmp(argv[1], "--jobs") == 0) {
+        int threads = argc >= 3 ? atoi(argv[2]) : 0;
+        if (threads <= 0) {
+            fputs("Usage: lisp --jobs n [file...]\n", stderr);
+            return 1;
+        }
+        lenv_add_builtins(global_env);
+        load_input_files(1, argv + 2, global_env);
+        jobs_run(global_env, argv + 3, argc - 3, threads);
+        return 0;
+    }
+
     lenv_add_builtins(global_env);
     load_input_files(argc, argv, global_env);
 
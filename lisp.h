@@ -0,0 +1,63 @@
+#ifndef LISP_H
+#define LISP_H
+
+#include <stddef.h>
+
+/*
+ * Embedding API of liblisp. Each interpreter owns its global environment
+ * and state, values returned to the host are owned by it and freed with
+ * lisp_value_free. An interpreter is used by one thread at a time,
+ * separate interpreters may run on different threads.
+ */
+
+#if defined(__GNUC__)
+#define LISP_API __attribute__((visibility("default")))
+#else
+#define LISP_API
+#endif
+
+typedef struct lval lisp_value;
+typedef struct lenv lisp_interp;
+
+/* Same order as the interpreter's own value types */
+enum {
+    LISP_ERROR, LISP_NUMBER, LISP_SYMBOL, LISP_STRING,
+    LISP_FUNCTION, LISP_SEXPR, LISP_QEXPR, LISP_SEQUENCE
+};
+
+/* Host function, borrows its arguments and returns a new value */
+typedef lisp_value *(*lisp_native)(lisp_interp *l, lisp_value **argv, int argc, void *data);
+
+/* Interpreter with only the builtins defined */
+LISP_API lisp_interp *lisp_new(void);
+LISP_API void lisp_free(lisp_interp *l);
+
+/* Load the standard library from file, NULL for ./library/standard_library.lisp */
+LISP_API lisp_value *lisp_load_stdlib(lisp_interp *l, const char *file);
+
+/* Evaluate each form, returning the value of the last or the first error */
+LISP_API lisp_value *lisp_eval_string(lisp_interp *l, const char *source);
+LISP_API lisp_value *lisp_eval_file(lisp_interp *l, const char *file);
+
+/* Bind name to a host function taking min to max arguments, max -1 for any */
+LISP_API void lisp_define(lisp_interp *l, const char *name, lisp_native fn,
+                          int min, int max, void *data);
+
+LISP_API int lisp_type(const lisp_value *v);
+LISP_API long lisp_number(const lisp_value *v);
+/* Text of strings and symbols or the message of errors, NULL otherwise */
+LISP_API const char *lisp_string(lisp_value *v, size_t *len);
+/* Elements of S-Expressions and Q-Expressions, items are borrowed */
+LISP_API int lisp_count(const lisp_value *v);
+LISP_API lisp_value *lisp_item(const lisp_value *v, int i);
+
+LISP_API lisp_value *lisp_make_number(long n);
+LISP_API lisp_value *lisp_make_string(const char *s, size_t len);
+LISP_API lisp_value *lisp_make_error(const char *message);
+LISP_API lisp_value *lisp_make_list(void);
+/* Append item, which now belongs to the list */
+LISP_API lisp_value *lisp_list_add(lisp_value *list, lisp_value *item);
+
+LISP_API void lisp_value_free(lisp_value *v);
+
+#endif
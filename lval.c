@@ -3,30 +3,124 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <pthread.h>
 #include "parser.c"
 
 struct lval;
 struct lenv;
+struct lmemo;
+struct lpartial;
+struct llambda;
+struct lcase;
+struct lseq;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lmemo lmemo;
+typedef struct lpartial lpartial;
+typedef struct llambda llambda;
+typedef struct lcase lcase;
+typedef struct lseq lseq;
+
+/* Interned symbol name, environments compare these by pointer */
+typedef struct lsym {
+    char *name;
+    size_t len;
+    unsigned long hash;
+
+    /* Number of live bindings outside of global environments */
+    atomic_int locals;
+    struct lsym *next;
+} lsym;
+
+/* Inline cache of a symbol in code, shared by all copies of the node */
+typedef struct lcache {
+    lrefs refs;
+
+    /* Slot the symbol was last found at in the innermost scope */
+    int slot;
+
+    /* Binding seen from the global environment global, valid while lenv_version is unchanged */
+    lenv *global;
+    unsigned long version;
+    lval *val;
+
+    /* Code of a frozen environment, shared by interpreters on other threads */
+    int frozen;
+} lcache;
 
 enum {
     LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR,
-    LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR
+    LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_SEQ
 };
 
 typedef lval *(*lbuiltin)(lenv *, lval *);
 
+/*
+ * Builtin taking a view of its evaluated arguments. It may keep an
+ * argument by setting its slot to NULL, the caller deletes the rest.
+ * It must not evaluate code, since the view points into the value stack.
+ */
+typedef lval *(*lbuiltin_vec)(lenv *, lval **, int);
+
+/* Builtin registered by a host, it borrows its arguments */
+typedef lval *(*lbuiltin_native)(lenv *, lval **, int, void *);
+
+/*
+ * Signature of a builtin. Types hold one letter per argument: n number,
+ * s string, q Q-Expression, f function or . for anything, the last letter
+ * also covers any further arguments. A max of -1 means no limit.
+ */
+typedef struct lbuiltin_def {
+    const char *name;
+    lbuiltin fn;
+    lbuiltin_vec vec;
+    int min;
+    int max;
+    const char *types;
+    int special;
+    lbuiltin_native native;
+    void *data;
+} lbuiltin_def;
+
+/* Errors keep a code and its details, the message is only built when needed */
+enum {
+    LERR_MESSAGE, LERR_UNBOUND, LERR_ARG_COUNT, LERR_ARG_TYPE,
+    LERR_ARG_EMPTY, LERR_DIV_ZERO
+};
+
+/* Strings up to this length are stored inline in the lval */
+#define LVAL_SMALL_STR 15
+
+/* Immutable buffer for long strings, shared between copies */
+typedef struct lstr_buf {
+    lrefs refs;
+
+    /* Entry in the hash-consing table, which does not keep the buffer alive */
+    struct lstr_intern *interned;
+    char data[];
+} lstr_buf;
+
 void lval_print(lval *v);
 
 lenv *lenv_new(void);
 
+lenv *lenv_new_local(void);
+
 void lenv_del(lenv *e);
 
 lenv *lenv_copy(lenv *e);
 
 void lenv_put(lenv *e, lval *k, lval *v);
 
+void lmemo_release(lmemo *m);
+
+unsigned long lval_content_hash(lval *v);
+unsigned long lval_hash(lval *v);
+int lval_eq(lval *x, lval *y);
+char *ltype_name(int t);
+char *lval_err_msg(lval *v);
+void lval_del(lval *v);
+
 struct lval {
     int type;
 
@@ -35,26 +129,361 @@ struct lval {
     char *err;
     char *sym;
     char *str;
+    lsym *id;
+    lcache *cache;
     code_context *context;
 
+    /* Error */
+    int code;
+    const char *func;
+    int details[3];
+
+    /* Text storage backing err, sym and str */
+    size_t len;
+    lstr_buf *buf;
+    char small[LVAL_SMALL_STR + 1];
+
     /* Function */
-    lbuiltin builtin;
-    lenv *env;
-    lval *formals;
-    lval *body;
+    const lbuiltin_def *builtin;
+    llambda *lambda;
+    lsym *name;
+
+    /* Defined by the standard library, which the optimizer may inline */
+    int library;
+    lmemo *memo;
+    lpartial *partial;
+
+    /* Lazy sequence */
+    lseq *seq;
 
     /* Expression */
     int count;
     lval **cell;
+
+    /* Jump table when this is a case call, see lcase */
+    lcase *jump;
+
+    /* Cached structural hash of strings and lists, see lval_hash */
+    int hashed;
+    unsigned long hash;
+
+    /* Body already went through the optimizer */
+    int optimized;
 };
 
+/* State of one interpreter, owned by its global environment */
+typedef struct lstate {
+    /* Optimize lambda bodies, (optimize 0) lasts until the end of a file */
+    int optimize;
+
+    /* File being loaded and the modules loaded by require */
+    char *loading;
+    struct lmodule *modules;
+
+    /* Set while the standard library itself is loading */
+    int library;
+
+    /* Builtins registered by the host */
+    lbuiltin_def **natives;
+    int native_count;
+
+    /* Green threads and channels, created on first use */
+    struct lsched *sched;
+
+    /* Open files, numbered from 1, NULL once closed */
+    struct lfile **files;
+    int file_count;
+} lstate;
+
 struct lenv {
     lenv *parent;
+
+    /* Root of the scope chain, itself for global environments */
+    lenv *global;
     int count;
-    char **syms;
+    lsym **syms;
     lval **vals;
+
+    /* Holds only the variable of a dotimes or for-each, = passes through */
+    int loop;
+
+    /* Only set on global environments */
+    lstate *state;
+};
+
+void lstate_del(lstate *s);
+
+typedef struct lmemo_entry {
+    unsigned long hash;
+    lval *args;
+    lval *result;
+    struct lmemo_entry *next;
+
+    /* Recency list, most recently used first */
+    struct lmemo_entry *newer;
+    struct lmemo_entry *older;
+} lmemo_entry;
+
+/* Parameters and code of a lambda, immutable once made so copies share them */
+struct llambda {
+    lrefs refs;
+    lval *formals;
+    lval *body;
+};
+
+/*
+ * Jump table of a case call whose clauses are all quoted literals with
+ * constant keys. Built when the code is read and shared by every copy,
+ * lval_add and lval_pop drop it as they change the call. Maps key hashes
+ * to clause indices, counted once the head of the call is popped.
+ */
+struct lcase {
+    lrefs refs;
+
+    /* Items of the call without its head */
+    int count;
+    int size;
+    unsigned long *hashes;
+    int *index;
+};
+
+/* Function applied to fewer arguments than it needs, shared by copies */
+struct lpartial {
+    lrefs refs;
+    lval *fn;
+
+    /* Q-Expression of the arguments bound so far */
+    lval *args;
+
+    /* Number of further arguments needed before fn is called */
+    int remaining;
+};
+
+enum {
+    LSEQ_RANGE, LSEQ_ITERATE, LSEQ_REPEAT, LSEQ_LIST,
+    LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE, LSEQ_LINES
+};
+
+/* Lazy sequence, how to produce its items rather than the items, shared by copies */
+struct lseq {
+    lrefs refs;
+    int kind;
+
+    /* Bounds and step of a range */
+    long from;
+    long to;
+    long step;
+
+    /* Items of a take, chunk size of a map, or file of lines */
+    long n;
+
+    /* Function of iterate, map and filter, value of iterate, repeat and list */
+    lval *fn;
+    lval *value;
+
+    /* Sequence read by map, filter and take */
+    lval *source;
+};
+
+/* Result cache shared by every copy of a memoized function */
+struct lmemo {
+    lrefs refs;
+    lval *fn;
+
+    /* Held while the table is used, parallel workers may share it */
+    pthread_mutex_t lock;
+
+    /* Maximum number of entries, 0 for unbounded */
+    long capacity;
+    long count;
+    long hits;
+    long misses;
+
+    int bucket_count;
+    lmemo_entry **buckets;
+    lmemo_entry *newest;
+    lmemo_entry *oldest;
 };
 
+char *lval_alloc_text(lval *v, size_t len) {
+    v->len = len;
+    if (len <= LVAL_SMALL_STR) {
+        v->buf = NULL;
+        v->small[len] = '\0';
+        return v->small;
+    }
+    v->buf = malloc(sizeof(lstr_buf) + len + 1);
+    v->buf->refs = 1;
+    v->buf->interned = NULL;
+    v->buf->data[len] = '\0';
+    return v->buf->data;
+}
+
+char *lval_set_text(lval *v, const char *s, size_t len) {
+    char *text = lval_alloc_text(v, len);
+    memcpy(text, s, len);
+    return text;
+}
+
+char *lval_share_text(lval *x, lval *v) {
+    x->len = v->len;
+    if (!v->buf) {
+        memcpy(x->small, v->small, v->len + 1);
+        return x->small;
+    }
+    /* Long strings are immutable so copies just take a reference */
+    x->buf = v->buf;
+    lref_inc(&x->buf->refs);
+    return x->buf->data;
+}
+
+void lval_release_text(lval *v);
+
+int lval_text_eq(lval *x, const char *a, lval *y, const char *b) {
+    /* Short circuit on length, then on shared buffer */
+    if (x->len != y->len) { return 0; }
+    if (a == b) { return 1; }
+    return memcmp(a, b, x->len) == 0;
+}
+
+/*
+ * Hash-consing table, long string and symbol literals share one buffer.
+ * Entries are weak, the last reference to a buffer takes it out.
+ */
+typedef struct lstr_intern {
+    unsigned long hash;
+    size_t len;
+    lstr_buf *buf;
+    struct lstr_intern *next;
+} lstr_intern;
+
+#define LSTR_INTERN_BUCKETS 1024
+
+int lval_hash_consing = 1;
+lstr_intern *lstr_interned[LSTR_INTERN_BUCKETS];
+
+/* Guards both intern tables, symbols can be made by parallel workers */
+pthread_mutex_t lval_intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long lval_hash_mix(unsigned long h, unsigned long x) {
+    return (h ^ x) * 1099511628211UL;
+}
+
+unsigned long lval_hash_bytes(unsigned long h, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h = lval_hash_mix(h, (unsigned char) s[i]);
+    }
+    return h;
+}
+
+#define LVAL_HASH_SEED 14695981039346656037UL
+
+char *lval_intern_text(lval *v, const char *s, size_t len) {
+    unsigned long hash = lval_hash_bytes(LVAL_HASH_SEED, s, len);
+    v->hashed = 1;
+    v->hash = hash;
+
+    if (!lval_hash_consing || len <= LVAL_SMALL_STR) {
+        return lval_set_text(v, s, len);
+    }
+
+    pthread_mutex_lock(&lval_intern_lock);
+    lstr_intern **slot = &lstr_interned[hash % LSTR_INTERN_BUCKETS];
+    for (lstr_intern *it = *slot; it; it = it->next) {
+        if (it->hash == hash && it->len == len && memcmp(it->buf->data, s, len) == 0) {
+            v->len = len;
+            v->buf = it->buf;
+            lref_inc(&v->buf->refs);
+            pthread_mutex_unlock(&lval_intern_lock);
+            return v->buf->data;
+        }
+    }
+
+    char *text = lval_set_text(v, s, len);
+    lstr_intern *it = calloc(1, sizeof(lstr_intern));
+    it->hash = hash;
+    it->len = len;
+    it->buf = v->buf;
+    it->buf->interned = it;
+    it->next = *slot;
+    *slot = it;
+    pthread_mutex_unlock(&lval_intern_lock);
+    return text;
+}
+
+void lval_release_text(lval *v) {
+    lstr_buf *b = v->buf;
+    if (b == NULL) { return; }
+    if (b->interned == NULL) {
+        if (lref_dec(&b->refs) == 0) { free(b); }
+        return;
+    }
+
+    /* Only the last reference needs the lock, a lookup may be taking a new one */
+    int refs = atomic_load(&b->refs);
+    while (refs > 1) {
+        if (atomic_compare_exchange_weak(&b->refs, &refs, refs - 1)) { return; }
+    }
+    pthread_mutex_lock(&lval_intern_lock);
+    if (lref_dec(&b->refs) == 0) {
+        lstr_intern **slot = &lstr_interned[b->interned->hash % LSTR_INTERN_BUCKETS];
+        while (*slot != b->interned) { slot = &(*slot)->next; }
+        *slot = b->interned->next;
+        free(b->interned);
+        free(b);
+    }
+    pthread_mutex_unlock(&lval_intern_lock);
+}
+
+#define LSYM_BUCKETS 4096
+
+lsym *lsym_table[LSYM_BUCKETS];
+
+lsym *lsym_intern(const char *name, size_t len) {
+    unsigned long hash = lval_hash_bytes(LVAL_HASH_SEED, name, len);
+    pthread_mutex_lock(&lval_intern_lock);
+    lsym **slot = &lsym_table[hash % LSYM_BUCKETS];
+    for (lsym *s = *slot; s; s = s->next) {
+        if (s->hash == hash && s->len == len && memcmp(s->name, name, len) == 0) {
+            pthread_mutex_unlock(&lval_intern_lock);
+            return s;
+        }
+    }
+
+    lsym *s = calloc(1, sizeof(lsym));
+    s->name = str_dup_n(name, len);
+    s->len = len;
+    s->hash = hash;
+    s->next = *slot;
+    *slot = s;
+    pthread_mutex_unlock(&lval_intern_lock);
+    return s;
+}
+
+/* Bumped whenever a global environment changes, invalidating caches */
+atomic_ulong lenv_version = 1;
+
+/*
+ * Set while a thread runs work of a parallel builtin, see pool.c. Globals
+ * cannot change then. At 1 only this thread runs the work and may still
+ * fill inline caches, at 2 other threads can be reading them.
+ */
+_Thread_local int lval_parallel = 0;
+
+/* Set once interpreters share a frozen environment, settings of the process are fixed from then */
+int lval_shared = 0;
+
+void lcache_release(lcache *c) {
+    if (c && lref_dec(&c->refs) == 0) { free(c); }
+}
+
+void lcase_release(lcase *t) {
+    if (t == NULL || lref_dec(&t->refs) > 0) { return; }
+    free(t->hashes);
+    free(t->index);
+    free(t);
+}
+
 lval *lval_num(long x, code_context *c) {
     lval *v = calloc(1, sizeof(lval));
     v->type = LVAL_NUM;
@@ -63,15 +492,84 @@ lval *lval_num(long x, code_context *c) {
     return v;
 }
 
-lval *lval_str(char *x, code_context *c) {
+lval *lval_str_n(const char *x, size_t len, code_context *c) {
     lval *v = calloc(1, sizeof(lval));
     v->type = LVAL_STR;
-    v->str = calloc(1, strlen(x) + 1);
-    strcpy(v->str, x);
+    v->str = lval_set_text(v, x, len);
     v->context = copy_context(c);
     return v;
 }
 
+/* Uninitialized string of len bytes, to be filled in by the caller */
+lval *lval_str_alloc(size_t len, code_context *c) {
+    lval *v = calloc(1, sizeof(lval));
+    v->type = LVAL_STR;
+    v->str = lval_alloc_text(v, len);
+    v->context = copy_context(c);
+    return v;
+}
+
+lval *lval_str(char *x, code_context *c) {
+    return lval_str_n(x, strlen(x), c);
+}
+
+/* Error with a static code, func must outlive the error */
+lval *lval_err_code(code_context *c, int code, const char *func,
+                    int d0, int d1, int d2) {
+    lval *v = calloc(1, sizeof(lval));
+    v->type = LVAL_ERR;
+    v->context = copy_context(c);
+    v->code = code;
+    v->func = func;
+    v->details[0] = d0;
+    v->details[1] = d1;
+    v->details[2] = d2;
+    return v;
+}
+
+int lbuiltin_type(char t) {
+    switch (t) {
+        case 'n': return LVAL_NUM;
+        case 's': return LVAL_STR;
+        case 'q': return LVAL_QEXPR;
+        case 'f': return LVAL_FUN;
+        case 'l': return LVAL_SEQ;
+        default: return -1;
+    }
+}
+
+/* Error for arguments that do not fit the signature of d, NULL if they do */
+lval *lbuiltin_check(const lbuiltin_def *d, lval **argv, int argc, code_context *c) {
+    if (argc < d->min || (d->max >= 0 && argc > d->max)) {
+        return lval_err_code(c, LERR_ARG_COUNT, d->name, argc, d->min, d->max);
+    }
+
+    int last = (int) strlen(d->types) - 1;
+    for (int i = 0; i < argc; i++) {
+        int expect = lbuiltin_type(d->types[i < last ? i : last]);
+        if (expect >= 0 && argv[i]->type != expect) {
+            return lval_err_code(c, LERR_ARG_TYPE, d->name, i, argv[i]->type, expect);
+        }
+    }
+    return NULL;
+}
+
+lval *lval_err_unbound(lval *k) {
+    lval *v = lval_err_code(k->context, LERR_UNBOUND, NULL, 0, 0, 0);
+    v->id = k->id;
+    return v;
+}
+
+/* Error carrying the text of a string, shared rather than formatted */
+lval *lval_err_str(lval *s, code_context *c) {
+    lval *v = calloc(1, sizeof(lval));
+    v->type = LVAL_ERR;
+    v->context = copy_context(c);
+    v->code = LERR_MESSAGE;
+    v->err = lval_share_text(v, s);
+    return v;
+}
+
 lval *lval_err(code_context *c, char *fmt, ...) {
     lval *v = calloc(1, sizeof(lval));
     v->type = LVAL_ERR;
@@ -81,14 +579,12 @@ lval *lval_err(code_context *c, char *fmt, ...) {
     va_list va;
     va_start(va, fmt);
 
-    /* Allocate 512 bytes of space */
-    v->err = calloc(1, 512);
-
     /* printf the error string with a maximum of 511 characters */
-    vsnprintf(v->err, 511, fmt, va);
-
-    /* Reallocate to number of bytes actually used */
-    v->err = realloc(v->err, strlen(v->err) + 1);
+    char msg[512];
+    int len = vsnprintf(msg, sizeof(msg), fmt, va);
+    if (len < 0) { len = 0; }
+    if (len > (int) sizeof(msg) - 1) { len = sizeof(msg) - 1; }
+    v->err = lval_set_text(v, msg, (size_t) len);
 
     /* Cleanup our va list */
     va_end(va);
@@ -99,9 +595,9 @@ lval *lval_err(code_context *c, char *fmt, ...) {
 lval *lval_sym(char *s, code_context *c) {
     lval *v = calloc(1, sizeof(lval));
     v->type = LVAL_SYM;
-    v->sym = calloc(1, strlen(s) + 1);
+    v->sym = lval_set_text(v, s, strlen(s));
+    v->id = lsym_intern(v->sym, v->len);
     v->context = copy_context(c);
-    strcpy(v->sym, s);
     return v;
 }
 
@@ -123,14 +619,62 @@ lval *lval_qexpr(code_context *c) {
     return v;
 }
 
-lval *lval_func(lbuiltin func) {
+lval *lval_func(const lbuiltin_def *def) {
     lval *v = calloc(1, sizeof(lval));
     v->type = LVAL_FUN;
-    v->builtin = func;
+    v->builtin = def;
     v->context = NULL;
     return v;
 }
 
+lval *lval_copy(lval *v);
+
+/* Takes ownership of args, f is shared or copied */
+lval *lval_partial(lval *f, lval *args, int remaining) {
+    lval *v = calloc(1, sizeof(lval));
+    v->type = LVAL_FUN;
+    v->partial = calloc(1, sizeof(lpartial));
+    v->partial->refs = 1;
+    v->partial->fn = lval_copy(f);
+    v->partial->args = args;
+    v->partial->args->type = LVAL_QEXPR;
+    v->partial->remaining = remaining;
+    v->context = copy_context(f->context);
+    return v;
+}
+
+lval *lval_seq(int kind, code_context *c) {
+    lval *v = calloc(1, sizeof(lval));
+    v->type = LVAL_SEQ;
+    v->seq = calloc(1, sizeof(lseq));
+    v->seq->refs = 1;
+    v->seq->kind = kind;
+    v->context = copy_context(c);
+    return v;
+}
+
+void lseq_release(lseq *s) {
+    if (lref_dec(&s->refs) > 0) { return; }
+    if (s->fn) { lval_del(s->fn); }
+    if (s->value) { lval_del(s->value); }
+    if (s->source) { lval_del(s->source); }
+    free(s);
+}
+
+void lpartial_release(lpartial *p) {
+    if (lref_dec(&p->refs) > 0) { return; }
+    lval_del(p->fn);
+    lval_del(p->args);
+    free(p);
+}
+
+void llambda_release(llambda *l) {
+    if (lref_dec(&l->refs) > 0) { return; }
+    lval_del(l->formals);
+    lval_del(l->body);
+    free(l);
+}
+
 lval *lval_lambda(lval *formals, lval *body, code_context *c) {
     lval *v = calloc(1, sizeof(lval));
     v->type = LVAL_FUN;
@@ -138,12 +682,13 @@ lval *lval_lambda(lval *formals, lval *body, code_context *c) {
     /* Set Builtin to Null */
     v->builtin = NULL;
 
-    /* Build new environment */
-    v->env = lenv_new();
-
-    /* Set Formals and Body */
-    v->formals = formals;
-    v->body = body;
+    /* Hashed now, threads holding copies then only read the shared code */
+    lval_content_hash(formals);
+    lval_content_hash(body);
+    v->lambda = calloc(1, sizeof(llambda));
+    v->lambda->refs = 1;
+    v->lambda->formals = formals;
+    v->lambda->body = body;
     v->context = copy_context(c);
     return v;
 }
@@ -152,11 +697,13 @@ void lval_del(lval *v) {
     switch (v->type) {
         case LVAL_NUM:
             break;
-        case LVAL_ERR:
-            free(v->err);
-            break;
         case LVAL_SYM:
-            free(v->sym);
+            lcache_release(v->cache);
+            lval_release_text(v);
+            break;
+        case LVAL_ERR:
+        case LVAL_STR:
+            lval_release_text(v);
             break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
@@ -164,16 +711,19 @@ void lval_del(lval *v) {
                 lval_del(v->cell[i]);
             }
             free(v->cell);
+            lcase_release(v->jump);
             break;
         case LVAL_FUN:
-            if (!v->builtin) {
-                lenv_del(v->env);
-                lval_del(v->formals);
-                lval_del(v->body);
+            if (v->memo) {
+                lmemo_release(v->memo);
+            } else if (v->partial) {
+                lpartial_release(v->partial);
+            } else if (!v->builtin) {
+                llambda_release(v->lambda);
             }
             break;
-        case LVAL_STR:
-            free(v->str);
+        case LVAL_SEQ:
+            lseq_release(v->seq);
             break;
         default:
             break;
@@ -190,16 +740,77 @@ lval *lval_read_num(ast *t) {
 }
 
 lval *lval_add(lval *v, lval *x) {
+    v->hashed = 0;
+    lcase_release(v->jump);
+    v->jump = NULL;
     v->count++;
     v->cell = realloc(v->cell, sizeof(lval *) * v->count);
     v->cell[v->count - 1] = x;
     return v;
 }
 
+lval *lval_read_text(ast *t, int type) {
+    lval *v = calloc(1, sizeof(lval));
+    v->type = type;
+    char *text = lval_intern_text(v, t->val, strlen(t->val));
+    if (type == LVAL_STR) {
+        v->str = text;
+    } else {
+        /* Symbols read from code get an inline cache for lookups */
+        v->sym = text;
+        v->id = lsym_intern(text, v->len);
+        v->cache = calloc(1, sizeof(lcache));
+        v->cache->refs = 1;
+    }
+    v->context = copy_context(t->context);
+    return v;
+}
+
+int lcase_key(lval *k) {
+    return k->type == LVAL_NUM || k->type == LVAL_STR || k->type == LVAL_QEXPR;
+}
+
+/* Jump table of v if it is a case call with literal clauses, else NULL */
+lcase *lcase_new(lval *v) {
+    if (v->count < 3 || v->cell[0]->type != LVAL_SYM || strcmp(v->cell[0]->sym, "case") != 0) {
+        return NULL;
+    }
+    for (int i = 2; i < v->count; i++) {
+        lval *clause = v->cell[i];
+        if (clause->type != LVAL_QEXPR || clause->count != 2 || !lcase_key(clause->cell[0])) {
+            return NULL;
+        }
+    }
+
+    lcase *t = calloc(1, sizeof(lcase));
+    t->refs = 1;
+    t->count = v->count - 1;
+    t->size = 1;
+    while (t->size < t->count * 2) { t->size *= 2; }
+    t->hashes = calloc((size_t) t->size, sizeof(unsigned long));
+    t->index = calloc((size_t) t->size, sizeof(int));
+
+    /* Open addressing, the first clause with a key wins */
+    for (int i = 1; i < t->count; i++) {
+        lval *key = v->cell[i + 1]->cell[0];
+        unsigned long h = lval_hash(key);
+        int slot = (int) (h & (unsigned long) (t->size - 1));
+        while (t->index[slot] &&
+               (t->hashes[slot] != h || !lval_eq(key, v->cell[t->index[slot] + 1]->cell[0]))) {
+            slot = (slot + 1) & (t->size - 1);
+        }
+        if (!t->index[slot]) {
+            t->hashes[slot] = h;
+            t->index[slot] = i;
+        }
+    }
+    return t;
+}
+
 lval *lval_read(ast *t) {
     if (t->type == AST_NUMBER) { return lval_read_num(t); }
-    if (t->type == AST_STRING) { return lval_str(t->val, t->context); }
-    if (t->type == AST_SYMBOL) { return lval_sym(t->val, t->context); }
+    if (t->type == AST_STRING) { return lval_read_text(t, LVAL_STR); }
+    if (t->type == AST_SYMBOL) { return lval_read_text(t, LVAL_SYM); }
 
     lval *v = NULL;
     if (t->type == AST_SEXPR) { v = lval_sexpr(t->context); }
@@ -208,6 +819,10 @@ lval *lval_read(ast *t) {
     for (int i = 0; i < t->child_count; i++)
         v = lval_add(v, lval_read(t->children[i]));
 
+    /* Quoted literals are data, hash them once so every copy carries it */
+    if (v->type == LVAL_QEXPR) { lval_content_hash(v); }
+    v->jump = lcase_new(v);
+
     return v;
 }
 
@@ -216,18 +831,31 @@ lval *lval_copy(lval *v) {
     lval *x = calloc(1, sizeof(lval));
     x->type = v->type;
     x->context = copy_context(v->context);
+    x->hashed = v->hashed;
+    x->hash = v->hash;
+    x->optimized = v->optimized;
 
     switch (v->type) {
 
         /* Copy Functions and Numbers Directly */
         case LVAL_FUN:
-            if (v->builtin) {
+            if (v->memo) {
+                /* Memoized functions share a single cache */
+                x->memo = v->memo;
+                lref_inc(&x->memo->refs);
+            } else if (v->partial) {
+                /* Partial applications are immutable so copies share them */
+                x->partial = v->partial;
+                lref_inc(&x->partial->refs);
+            } else if (v->builtin) {
                 x->builtin = v->builtin;
             } else {
+                /* Lambdas are immutable too, copies share their code */
                 x->builtin = NULL;
-                x->env = lenv_copy(v->env);
-                x->formals = lval_copy(v->formals);
-                x->body = lval_copy(v->body);
+                x->lambda = v->lambda;
+                lref_inc(&x->lambda->refs);
+                x->name = v->name;
+                x->library = v->library;
             }
             break;
         case LVAL_NUM:
@@ -235,13 +863,23 @@ lval *lval_copy(lval *v) {
             break;
 
         case LVAL_ERR:
-            x->err = calloc(1, strlen(v->err) + 1);
-            strcpy(x->err, v->err);
+            x->code = v->code;
+            x->func = v->func;
+            x->id = v->id;
+            memcpy(x->details, v->details, sizeof(v->details));
+            if (v->err) { x->err = lval_share_text(x, v); }
             break;
 
         case LVAL_SYM:
-            x->sym = calloc(1, strlen(v->sym) + 1);
-            strcpy(x->sym, v->sym);
+            x->sym = lval_share_text(x, v);
+            x->id = v->id;
+            x->cache = v->cache;
+            if (x->cache) { lref_inc(&x->cache->refs); }
+            break;
+
+        case LVAL_SEQ:
+            x->seq = v->seq;
+            lref_inc(&x->seq->refs);
             break;
 
             /* Copy Lists by copying each sub-expression */
@@ -252,10 +890,11 @@ lval *lval_copy(lval *v) {
             for (int i = 0; i < x->count; i++) {
                 x->cell[i] = lval_copy(v->cell[i]);
             }
+            x->jump = v->jump;
+            if (x->jump) { lref_inc(&x->jump->refs); }
             break;
         case LVAL_STR:
-            x->str = calloc(1, strlen(v->str) + 1);
-            strcpy(x->str, v->str);
+            x->str = lval_share_text(x, v);
             break;
         default:
             break;
@@ -266,9 +905,15 @@ lval *lval_copy(lval *v) {
 
 int lval_eq(lval *x, lval *y) {
 
+    /* Identical values are always equal */
+    if (x == y) { return 1; }
+
     /* Different Types are always unequal */
     if (x->type != y->type) { return 0; }
 
+    /* Different cached hashes are always unequal */
+    if (x->hashed && y->hashed && x->hash != y->hash) { return 0; }
+
     /* Compare Based upon type */
     switch (x->type) {
         /* Compare Number Value */
@@ -277,17 +922,26 @@ int lval_eq(lval *x, lval *y) {
 
             /* Compare String Values */
         case LVAL_ERR:
-            return (strcmp(x->err, y->err) == 0);
+            return lval_text_eq(x, lval_err_msg(x), y, lval_err_msg(y));
         case LVAL_SYM:
-            return (strcmp(x->sym, y->sym) == 0);
+            return x->id == y->id;
 
             /* If builtin compare, otherwise compare formals and body */
         case LVAL_FUN:
+            if (x->memo || y->memo) {
+                return x->memo == y->memo;
+            }
+            if (x->partial || y->partial) {
+                if (!x->partial || !y->partial) { return 0; }
+                return lval_eq(x->partial->fn, y->partial->fn)
+                       && lval_eq(x->partial->args, y->partial->args);
+            }
             if (x->builtin || y->builtin) {
                 return x->builtin == y->builtin;
             } else {
-                return lval_eq(x->formals, y->formals)
-                       && lval_eq(x->body, y->body);
+                if (x->lambda == y->lambda) { return 1; }
+                return lval_eq(x->lambda->formals, y->lambda->formals)
+                       && lval_eq(x->lambda->body, y->lambda->body);
             }
 
             /* If list compare every individual element */
@@ -301,12 +955,70 @@ int lval_eq(lval *x, lval *y) {
             /* Otherwise lists must be equal */
             return 1;
         case LVAL_STR:
-            return (strcmp(x->str, y->str) == 0);
+            return lval_text_eq(x, x->str, y, y->str);
+
+            /* Sequences may be endless, only copies of one are equal */
+        case LVAL_SEQ:
+            return x->seq == y->seq;
         default:
             return 0;
     }
 }
 
+unsigned long lval_hash(lval *v);
+
+/*
+ * Hash of the value ignoring its type. Strings and lists cache it,
+ * lval_add and lval_pop drop the cache as they change the list.
+ */
+unsigned long lval_content_hash(lval *v) {
+    if (v->hashed) { return v->hash; }
+
+    unsigned long h = LVAL_HASH_SEED;
+    switch (v->type) {
+        case LVAL_NUM:
+            return lval_hash_mix(h, (unsigned long) v->num);
+        case LVAL_FUN:
+            if (v->memo) { return lval_hash_mix(h, (unsigned long) v->memo); }
+            if (v->partial) {
+                h = lval_hash_mix(h, lval_hash(v->partial->fn));
+                return lval_hash_mix(h, lval_hash(v->partial->args));
+            }
+            if (v->builtin) { return lval_hash_mix(h, (unsigned long) v->builtin); }
+            h = lval_hash_mix(h, lval_hash(v->lambda->formals));
+            return lval_hash_mix(h, lval_hash(v->lambda->body));
+        case LVAL_ERR:
+            h = lval_hash_bytes(h, lval_err_msg(v), v->len);
+            break;
+        case LVAL_SYM:
+            h = lval_hash_bytes(h, v->sym, v->len);
+            break;
+        case LVAL_STR:
+            h = lval_hash_bytes(h, v->str, v->len);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) {
+                h = lval_hash_mix(h, lval_hash(v->cell[i]));
+            }
+            break;
+        case LVAL_SEQ:
+            h = lval_hash_mix(h, (unsigned long) v->seq);
+            break;
+        default:
+            return h;
+    }
+
+    v->hashed = 1;
+    v->hash = h;
+    return h;
+}
+
+/* Structural hash, consistent with lval_eq */
+unsigned long lval_hash(lval *v) {
+    return lval_hash_mix(lval_content_hash(v), (unsigned long) v->type);
+}
+
 lval *lval_pop(lval *v, int i) {
     /* Find the item at "i" */
     lval *x = v->cell[i];
@@ -317,6 +1029,13 @@ lval *lval_pop(lval *v, int i) {
 
     /* Decrease the count of items in the list */
     v->count--;
+    v->hashed = 0;
+
+    /* The head of a case call goes before it runs, other changes void its table */
+    if (i > 0) {
+        lcase_release(v->jump);
+        v->jump = NULL;
+    }
 
     /* Reallocate the memory used */
     v->cell = realloc(v->cell, sizeof(lval *) * v->count);
@@ -341,6 +1060,52 @@ lval *lval_join(lval *x, lval *y) {
     return x;
 }
 
+/* Message of an error, formatted on first use */
+char *lval_err_msg(lval *v) {
+    if (v->err) { return v->err; }
+
+    char msg[512];
+    int *d = v->details;
+    switch (v->code) {
+        case LERR_UNBOUND:
+            snprintf(msg, sizeof(msg), "Unbound Symbol '%s'", v->id->name);
+            break;
+        case LERR_ARG_COUNT:
+            if (d[1] == d[2]) {
+                snprintf(msg, sizeof(msg),
+                         "Function '%s' passed incorrect number of arguments. "
+                         "Got %i, Expected %i.", v->func, d[0], d[1]);
+            } else if (d[2] < 0) {
+                snprintf(msg, sizeof(msg),
+                         "Function '%s' passed incorrect number of arguments. "
+                         "Got %i, Expected at least %i.", v->func, d[0], d[1]);
+            } else {
+                snprintf(msg, sizeof(msg),
+                         "Function '%s' passed incorrect number of arguments. "
+                         "Got %i, Expected %i to %i.", v->func, d[0], d[1], d[2]);
+            }
+            break;
+        case LERR_ARG_TYPE:
+            snprintf(msg, sizeof(msg),
+                     "Function '%s' passed incorrect type for argument %i. "
+                     "Got %s, Expected %s.",
+                     v->func, d[0], ltype_name(d[1]), ltype_name(d[2]));
+            break;
+        case LERR_ARG_EMPTY:
+            snprintf(msg, sizeof(msg), "Function '%s' passed {} for argument %i.",
+                     v->func, d[0]);
+            break;
+        case LERR_DIV_ZERO:
+            snprintf(msg, sizeof(msg), "Division By Zero!");
+            break;
+        default:
+            msg[0] = '\0';
+            break;
+    }
+    v->err = lval_set_text(v, msg, strlen(msg));
+    return v->err;
+}
+
 char *ltype_name(int t) {
     switch (t) {
         case LVAL_FUN:
@@ -355,6 +1120,8 @@ char *ltype_name(int t) {
             return "S-Expression";
         case LVAL_QEXPR:
             return "Q-Expression";
+        case LVAL_SEQ:
+            return "Sequence";
         case LVAL_STR:
             return "String";
         default:
@@ -362,8 +1129,62 @@ char *ltype_name(int t) {
     }
 }
 
+/* Growing byte buffer */
+typedef struct lbuf {
+    char *data;
+    size_t len;
+    size_t size;
+} lbuf;
+
+void lbuf_reserve(lbuf *b, size_t n) {
+    if (b->len + n <= b->size) { return; }
+    while (b->len + n > b->size) { b->size = b->size ? b->size * 2 : 256; }
+    b->data = realloc(b->data, b->size);
+}
+
+void lbuf_write(lbuf *b, const char *s, size_t n) {
+    lbuf_reserve(b, n);
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+/* Printed values go to stdout, or to this buffer when it is set */
+_Thread_local lbuf *lval_out = NULL;
+
+void lout_write(const char *s, size_t n) {
+    if (lval_out) {
+        lbuf_write(lval_out, s, n);
+    } else {
+        fwrite(s, 1, n, stdout);
+    }
+}
+
+void lout_putc(char c) {
+    lout_write(&c, 1);
+}
+
+void lout_printf(const char *fmt, ...) {
+    char small[256];
+    va_list va;
+    va_start(va, fmt);
+    int len = vsnprintf(small, sizeof(small), fmt, va);
+    va_end(va);
+    if (len < 0) { return; }
+    if (len < (int) sizeof(small)) {
+        lout_write(small, (size_t) len);
+        return;
+    }
+
+    char *big = malloc((size_t) len + 1);
+    va_start(va, fmt);
+    vsnprintf(big, (size_t) len + 1, fmt, va);
+    va_end(va);
+    lout_write(big, (size_t) len);
+    free(big);
+}
+
 void lval_expr_print(lval *v, char open, char close) {
-    putchar(open);
+    lout_putc(open);
     for (int i = 0; i < v->count; i++) {
 
         /* Print Value contained within */
@@ -371,27 +1192,27 @@ void lval_expr_print(lval *v, char open, char close) {
 
         /* Don't print trailing space if last element */
         if (i != (v->count - 1)) {
-            putchar(' ');
+            lout_putc(' ');
         }
     }
-    putchar(close);
+    lout_putc(close);
 }
 
 void lval_print(lval *v) {
     switch (v->type) {
         case LVAL_NUM:
-            printf("%li", v->num);
+            lout_printf("%li", v->num);
             break;
         case LVAL_ERR:
             if (v->context)
-            printf("Error: %s\n"
+            lout_printf("Error: %s\n"
                    "Context (Row %d Column %d):\n%.50s\n",
-                   v->err, v->context->row, v->context->col, v->context->trace);
+                   lval_err_msg(v), v->context->row, v->context->col, v->context->trace);
             else
-                printf("Error: %s\n",v->err);
+                lout_printf("Error: %s\n", lval_err_msg(v));
             break;
         case LVAL_SYM:
-            printf("%s", v->sym);
+            lout_printf("%s", v->sym);
             break;
         case LVAL_SEXPR:
             lval_expr_print(v, '(', ')');
@@ -400,18 +1221,33 @@ void lval_print(lval *v) {
             lval_expr_print(v, '{', '}');
             break;
         case LVAL_FUN:
-            if (v->builtin) {
-                printf("<builtin>");
+            if (v->memo) {
+                lout_printf("(memo ");
+                lval_print(v->memo->fn);
+                lout_putc(')');
+            } else if (v->partial) {
+                lout_printf("(partial ");
+                lval_print(v->partial->fn);
+                lout_putc(' ');
+                lval_print(v->partial->args);
+                lout_putc(')');
+            } else if (v->builtin) {
+                lout_printf("<builtin>");
             } else {
-                printf("(lambda ");
-                lval_print(v->formals);
-                putchar(' ');
-                lval_print(v->body);
-                putchar(')');
+                lout_printf("(lambda ");
+                lval_print(v->lambda->formals);
+                lout_putc(' ');
+                lval_print(v->lambda->body);
+                lout_putc(')');
             }
             break;
         case LVAL_STR:
-            printf("\"%s\"", v->str);
+            lout_putc('"');
+            lout_write(v->str, v->len);
+            lout_putc('"');
+            break;
+        case LVAL_SEQ:
+            lout_printf("<sequence>");
             break;
         default:
             break;
@@ -420,48 +1256,106 @@ void lval_print(lval *v) {
 
 void lval_println(lval *v) {
     lval_print(v);
-    putchar('\n');
+    lout_putc('\n');
 }
 
 lenv *lenv_new(void) {
     lenv *e = calloc(1, sizeof(lenv));
     e->parent = NULL;
+    e->global = e;
     e->count = 0;
     e->syms = NULL;
     e->vals = NULL;
+    e->state = calloc(1, sizeof(lstate));
+    e->state->optimize = 1;
     return e;
 }
 
+/* Environment of a function or scope, attached with lenv_set_parent */
+lenv *lenv_new_local(void) {
+    return calloc(1, sizeof(lenv));
+}
+
+lstate *lenv_state(lenv *e) {
+    return e->global->state;
+}
+
+int lenv_is_global(lenv *e) {
+    return e->global == e;
+}
+
+void lenv_set_parent(lenv *e, lenv *parent) {
+    e->parent = parent;
+    e->global = parent->global;
+}
+
 void lenv_del(lenv *e) {
+    int local = !lenv_is_global(e);
     for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
+        if (local) { e->syms[i]->locals--; }
         lval_del(e->vals[i]);
     }
+    if (!local) {
+        lenv_version++;
+        lstate_del(e->state);
+    }
     free(e->syms);
     free(e->vals);
     free(e);
 }
 
+/* Find the binding of k without copying it, also reporting its scope */
+lval *lenv_lookup(lenv *e, lval *k, lenv **owner, int *slot) {
+    for (; e; e = e->parent) {
+        for (int i = 0; i < e->count; i++) {
+            if (e->syms[i] == k->id) {
+                *owner = e;
+                *slot = i;
+                return e->vals[i];
+            }
+        }
+    }
+    return NULL;
+}
+
 lval *lenv_get(lenv *e, lval *k) {
+    lcache *c = k->cache;
 
-    /* Iterate over all items in environment */
-    for (int i = 0; i < e->count; i++) {
-        /* Check if the stored string matches the symbol string */
-        /* If it does, return a copy of the value */
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+    if (c) {
+        /* Same slot of the innermost scope as last time */
+        if (c->slot < e->count && e->syms[c->slot] == k->id) {
+            return lval_copy(e->vals[c->slot]);
+        }
+
+        /* Global binding, valid if unchanged and not shadowed anywhere */
+        if (c->val && c->version == lenv_version &&
+            c->global == e->global && k->id->locals == 0) {
+            return lval_copy(c->val);
         }
     }
 
-    /* If no symbol check in parent otherwise error */
-    if (e->parent) {
-        return lenv_get(e->parent, k);
-    } else {
-        return lval_err(k->context, "Unbound Symbol '%s'", k->sym);
+    lenv *owner;
+    int slot;
+    lval *v = lenv_lookup(e, k, &owner, &slot);
+    if (v == NULL) { return lval_err_unbound(k); }
+
+    if (c && lval_parallel < 2 && !c->frozen) {
+        if (owner == e) { c->slot = slot; }
+        if (lenv_is_global(owner)) {
+            c->global = e->global;
+            c->version = lenv_version;
+            c->val = v;
+        }
     }
+    return lval_copy(v);
 }
 
-void lenv_put(lenv *e, lval *k, lval *v) {
+/* Bind k to v, taking ownership of v */
+void lenv_set(lenv *e, lval *k, lval *v) {
+
+    /* Changing a global invalidates every cached global binding */
+    int global = lenv_is_global(e);
+    if (global) { lenv_version++; }
 
     /* Iterate over all items in environment */
     /* This is to see if variable already exists */
@@ -469,9 +1363,9 @@ void lenv_put(lenv *e, lval *k, lval *v) {
 
         /* If variable is found delete item at that position */
         /* And replace with variable supplied by user */
-        if (strcmp(e->syms[i], k->sym) == 0) {
+        if (e->syms[i] == k->id) {
             lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
+            e->vals[i] = v;
             return;
         }
     }
@@ -479,31 +1373,67 @@ void lenv_put(lenv *e, lval *k, lval *v) {
     /* If no existing entry found allocate space for new entry */
     e->count++;
     e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-    e->syms = realloc(e->syms, sizeof(char *) * e->count);
+    e->syms = realloc(e->syms, sizeof(lsym *) * e->count);
 
-    /* Copy contents of lval and symbol string into new location */
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = calloc(1, strlen(k->sym) + 1);
-    strcpy(e->syms[e->count - 1], k->sym);
+    /* Store the value and the interned symbol */
+    e->vals[e->count - 1] = v;
+    e->syms[e->count - 1] = k->id;
+    if (!global) { k->id->locals++; }
+}
+
+void lenv_put(lenv *e, lval *k, lval *v) {
+    lenv_set(e, k, lval_copy(v));
 }
 
 lenv *lenv_copy(lenv *e) {
     lenv *n = calloc(1, sizeof(lenv));
     n->parent = e->parent;
+    n->global = lenv_is_global(e) ? n : e->global;
     n->count = e->count;
-    n->syms = calloc((size_t) n->count, sizeof(char *));
+    n->syms = calloc((size_t) n->count, sizeof(lsym *));
     n->vals = calloc((size_t) n->count, sizeof(lval *));
     for (int i = 0; i < e->count; i++) {
-        n->syms[i] = calloc(1, strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
+        n->syms[i] = e->syms[i];
+        if (!lenv_is_global(n)) { n->syms[i]->locals++; }
         n->vals[i] = lval_copy(e->vals[i]);
     }
     return n;
 }
 
 void lenv_def(lenv *e, lval *k, lval *v) {
-    /* Iterate till e has no parent */
-    while (e->parent) { e = e->parent; }
-    /* Put value in e */
-    lenv_put(e, k, v);
+    /* Globals of a shared environment go into the interpreter's own */
+    lenv_put(e->global, k, v);
 }
+
+/* Stop the inline caches in the code of v from being written */
+void lval_freeze(lval *v) {
+    if (v->cache) { v->cache->frozen = 1; }
+    if (v->lambda) {
+        lval_freeze(v->lambda->formals);
+        lval_freeze(v->lambda->body);
+    }
+    if (v->memo) { lval_freeze(v->memo->fn); }
+    if (v->partial) {
+        lval_freeze(v->partial->fn);
+        lval_freeze(v->partial->args);
+    }
+    if (v->seq) {
+        if (v->seq->fn) { lval_freeze(v->seq->fn); }
+        if (v->seq->value) { lval_freeze(v->seq->value); }
+        if (v->seq->source) { lval_freeze(v->seq->source); }
+    }
+    for (int i = 0; i < v->count; i++) { lval_freeze(v->cell[i]); }
+}
+
+/* Make e read-only so interpreters on several threads can share it */
+void lenv_freeze(lenv *e) {
+    for (int i = 0; i < e->count; i++) { lval_freeze(e->vals[i]); }
+    lval_shared = 1;
+}
+
+/* Global environment of a new interpreter, looking up what it lacks in the frozen base */
+lenv *lenv_new_shared(lenv *base) {
+    lenv *e = lenv_new();
+    e->parent = base;
+    return e;
+}
\ No newline at end of file
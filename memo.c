@@ -0,0 +1,141 @@
+#include "lval.c"
+
+#define LMEMO_INITIAL_BUCKETS 64
+
+lval *lval_call(lenv *e, lval *f, lval *a);
+
+lmemo *lmemo_new(lval *fn, long capacity) {
+    lmemo *m = calloc(1, sizeof(lmemo));
+    m->refs = 1;
+    m->fn = fn;
+    pthread_mutex_init(&m->lock, NULL);
+    m->capacity = capacity;
+    m->bucket_count = LMEMO_INITIAL_BUCKETS;
+    m->buckets = calloc((size_t) m->bucket_count, sizeof(lmemo_entry *));
+    return m;
+}
+
+void lmemo_entry_del(lmemo_entry *entry) {
+    lval_del(entry->args);
+    lval_del(entry->result);
+    free(entry);
+}
+
+void lmemo_release(lmemo *m) {
+    if (lref_dec(&m->refs) > 0) { return; }
+
+    lmemo_entry *entry = m->newest;
+    while (entry) {
+        lmemo_entry *older = entry->older;
+        lmemo_entry_del(entry);
+        entry = older;
+    }
+    lval_del(m->fn);
+    pthread_mutex_destroy(&m->lock);
+    free(m->buckets);
+    free(m);
+}
+
+void lmemo_unlink(lmemo *m, lmemo_entry *entry) {
+    if (entry->newer) { entry->newer->older = entry->older; }
+    else { m->newest = entry->older; }
+    if (entry->older) { entry->older->newer = entry->newer; }
+    else { m->oldest = entry->newer; }
+}
+
+void lmemo_push(lmemo *m, lmemo_entry *entry) {
+    entry->newer = NULL;
+    entry->older = m->newest;
+    if (m->newest) { m->newest->newer = entry; }
+    m->newest = entry;
+    if (!m->oldest) { m->oldest = entry; }
+}
+
+void lmemo_evict_oldest(lmemo *m) {
+    lmemo_entry *entry = m->oldest;
+    lmemo_entry **slot = &m->buckets[entry->hash % m->bucket_count];
+    while (*slot != entry) { slot = &(*slot)->next; }
+    *slot = entry->next;
+
+    lmemo_unlink(m, entry);
+    lmemo_entry_del(entry);
+    m->count--;
+}
+
+void lmemo_grow(lmemo *m) {
+    int bucket_count = m->bucket_count * 2;
+    lmemo_entry **buckets = calloc((size_t) bucket_count, sizeof(lmemo_entry *));
+
+    for (lmemo_entry *entry = m->newest; entry; entry = entry->older) {
+        lmemo_entry **slot = &buckets[entry->hash % bucket_count];
+        entry->next = *slot;
+        *slot = entry;
+    }
+
+    free(m->buckets);
+    m->buckets = buckets;
+    m->bucket_count = bucket_count;
+}
+
+lmemo_entry *lmemo_lookup(lmemo *m, lval *args, unsigned long hash) {
+    lmemo_entry *entry = m->buckets[hash % m->bucket_count];
+    for (; entry; entry = entry->next) {
+        /* Hashes can collide so confirm with a structural compare */
+        if (entry->hash == hash && lval_eq(entry->args, args)) { return entry; }
+    }
+    return NULL;
+}
+
+void lmemo_insert(lmemo *m, lval *args, lval *result, unsigned long hash) {
+    lmemo_entry *entry = calloc(1, sizeof(lmemo_entry));
+    entry->hash = hash;
+    entry->args = args;
+    entry->result = result;
+
+    lmemo_entry **slot = &m->buckets[hash % m->bucket_count];
+    entry->next = *slot;
+    *slot = entry;
+    lmemo_push(m, entry);
+    m->count++;
+
+    if (m->capacity > 0 && m->count > m->capacity) { lmemo_evict_oldest(m); }
+    if (m->count > m->bucket_count * 2) { lmemo_grow(m); }
+}
+
+lval *lmemo_call(lenv *e, lmemo *m, lval *a) {
+    unsigned long hash = lval_hash(a);
+
+    pthread_mutex_lock(&m->lock);
+    lmemo_entry *entry = lmemo_lookup(m, a, hash);
+    if (entry) {
+        m->hits++;
+        lmemo_unlink(m, entry);
+        lmemo_push(m, entry);
+        lval *result = lval_copy(entry->result);
+        pthread_mutex_unlock(&m->lock);
+        lval_del(a);
+        return result;
+    }
+    m->misses++;
+    pthread_mutex_unlock(&m->lock);
+
+    /* The call runs unlocked, it may recurse into this function */
+    lval *args = lval_copy(a);
+    lval *result = lval_call(e, m->fn, a);
+
+    /* Errors are not cached so that they get reported every time */
+    if (result->type == LVAL_ERR) {
+        lval_del(args);
+        return result;
+    }
+
+    /* The recursive call may have filled this slot already */
+    pthread_mutex_lock(&m->lock);
+    if (lmemo_lookup(m, args, hash)) {
+        lval_del(args);
+    } else {
+        lmemo_insert(m, args, lval_copy(result), hash);
+    }
+    pthread_mutex_unlock(&m->lock);
+    return result;
+}
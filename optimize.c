@@ -0,0 +1,232 @@
+#include "memo.c"
+
+/*
+ * Optimization pass run over lambda bodies when they are created.
+ * Folds pure calls whose arguments are all literals, inlines trivial
+ * standard library wrappers and drops if branches that can never run.
+ * Globals are resolved when the function is defined, (optimize 0)
+ * turns the pass off for the rest of the file being loaded. Only the
+ * original builtins and library functions are touched, whatever name
+ * they are bound to, so user redefinitions always win.
+ */
+
+lval *lbuiltin_run(lenv *e, const lbuiltin_def *d, lval *a);
+
+char *opt_pure[] = {
+        "+", "-", "*", "/", "%", "<", ">", "<=", ">=", "==", "!=",
+        "!", "||", "&&",
+        "head", "tail", "list", "join",
+        "str-len", "substr", "concat", "split-str", "join-str", "find",
+        "replace", "starts-with", "to-num", "num-to-str",
+        NULL
+};
+
+lval *opt_expr(lenv *e, lval *x, lval *formals);
+
+int opt_is_literal(lval *x) {
+    return x->type == LVAL_NUM || x->type == LVAL_STR || x->type == LVAL_QEXPR;
+}
+
+/* Arguments that can be reordered or duplicated without side effects */
+int opt_is_simple(lval *x) {
+    return opt_is_literal(x) || x->type == LVAL_SYM;
+}
+
+int opt_all_literal(lval *x) {
+    for (int i = 1; i < x->count; i++) {
+        if (!opt_is_literal(x->cell[i])) { return 0; }
+    }
+    return 1;
+}
+
+int opt_is_formal(lval *formals, lval *sym) {
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->id == sym->id) { return 1; }
+    }
+    return 0;
+}
+
+/* Global binding of a head symbol, NULL if it may be rebound by the call */
+lval *opt_global(lenv *e, lval *head, lval *formals) {
+    if (head->type != LVAL_SYM || opt_is_formal(formals, head)) { return NULL; }
+
+    lenv *owner;
+    int slot;
+    lval *v = lenv_lookup(e, head, &owner, &slot);
+    if (v == NULL || !lenv_is_global(owner) || v->type != LVAL_FUN) { return NULL; }
+    return v;
+}
+
+/* Builtin from the table, not one registered by the host */
+int opt_is_builtin(lval *f, char *name) {
+    return f->builtin && !f->builtin->native && strcmp(f->builtin->name, name) == 0;
+}
+
+/* Lambda defined by the standard library under this name */
+int opt_is_library(lval *f, char *name) {
+    return f->library && f->name && strcmp(f->name->name, name) == 0;
+}
+
+int opt_is_pure(lval *f) {
+    if (f->builtin == NULL || f->builtin->native) { return 0; }
+    for (int i = 0; opt_pure[i]; i++) {
+        if (strcmp(f->builtin->name, opt_pure[i]) == 0) { return 1; }
+    }
+    return 0;
+}
+
+lval *opt_sym(char *name, code_context *c) {
+    lval *v = lval_sym(name, c);
+    v->cache = calloc(1, sizeof(lcache));
+    v->cache->refs = 1;
+    return v;
+}
+
+/* (head-sym x) */
+lval *opt_call1(char *name, lval *x) {
+    lval *v = lval_sexpr(x->context);
+    lval_add(v, opt_sym(name, x->context));
+    return lval_add(v, x);
+}
+
+lval *opt_call(lenv *e, lval *x, lval *formals);
+
+/* Optimize a quoted body that is evaluated as one S-Expression */
+lval *opt_body(lenv *e, lval *body, lval *formals) {
+    if (body->optimized) { return body; }
+
+    body->type = LVAL_SEXPR;
+    lval *x = opt_call(e, body, formals);
+
+    if (x->type == LVAL_SEXPR) {
+        x->type = LVAL_QEXPR;
+    } else {
+        /* Folded to a single value, keep it as a one element body */
+        x = lval_add(lval_qexpr(x->context), x);
+    }
+    x->optimized = 1;
+    return x;
+}
+
+/* Optimize the quoted bodies among the arguments of x */
+void opt_bodies(lenv *e, lval *x, int from, lval *formals) {
+    for (int i = from; i < x->count; i++) {
+        if (x->cell[i]->type == LVAL_QEXPR) {
+            x->cell[i] = opt_body(e, x->cell[i], formals);
+        }
+    }
+}
+
+/* Optimize each element of quoted clauses, as used by select */
+void opt_clauses(lenv *e, lval *x, int from, lval *formals) {
+    for (int i = from; i < x->count; i++) {
+        lval *clause = x->cell[i];
+        if (clause->type != LVAL_QEXPR) { continue; }
+        for (int j = 0; j < clause->count; j++) {
+            clause->cell[j] = opt_expr(e, clause->cell[j], formals);
+        }
+        clause->hashed = 0;
+    }
+}
+
+/* Inline fst, snd and trd as (eval (head (tail ...))) */
+lval *opt_inline_nth(lval *x, int n) {
+    lval *l = lval_pop(x, 1);
+    lval_del(x);
+    for (int i = 0; i < n; i++) { l = opt_call1("tail", l); }
+    return opt_call1("eval", opt_call1("head", l));
+}
+
+lval *opt_call(lenv *e, lval *x, lval *formals) {
+    for (int i = 0; i < x->count; i++) {
+        x->cell[i] = opt_expr(e, x->cell[i], formals);
+    }
+    x->hashed = 0;
+
+    if (x->count == 0) { return x; }
+    lval *head = x->cell[0];
+    lval *f = opt_global(e, head, formals);
+    if (f == NULL) { return x; }
+    int args = x->count - 1;
+
+    /* Code arguments of builtins that take quoted bodies */
+    if (args == 3 && opt_is_builtin(f, "if")) {
+        opt_bodies(e, x, 2, formals);
+
+        /* A literal condition decides the branch at definition time */
+        if (x->cell[1]->type == LVAL_NUM && x->cell[2]->type == LVAL_QEXPR &&
+            x->cell[3]->type == LVAL_QEXPR) {
+            lval *branch = lval_pop(x, x->cell[1]->num ? 2 : 3);
+            lval_del(x);
+            branch->type = LVAL_SEXPR;
+            return branch;
+        }
+        return x;
+    }
+    if (args == 2 && opt_is_builtin(f, "lambda")) {
+        if (x->cell[1]->type == LVAL_QEXPR && x->cell[2]->type == LVAL_QEXPR) {
+            lval *inner = lval_join(lval_copy(formals), lval_copy(x->cell[1]));
+            x->cell[2] = opt_body(e, x->cell[2], inner);
+            lval_del(inner);
+        }
+        return x;
+    }
+    if (opt_is_builtin(f, "while") || opt_is_builtin(f, "let") ||
+        opt_is_builtin(f, "try") || opt_is_builtin(f, "catch")) {
+        opt_bodies(e, x, 1, formals);
+        return x;
+    }
+    if (opt_is_builtin(f, "select")) {
+        opt_clauses(e, x, 1, formals);
+        return x;
+    }
+    if (args == 2 && (opt_is_builtin(f, "dotimes") || opt_is_builtin(f, "for-each"))) {
+        opt_bodies(e, x, 2, formals);
+        return x;
+    }
+
+    /* Fold pure calls whose arguments are all literals */
+    if (opt_is_pure(f) && opt_all_literal(x)) {
+        /* Literal argument types are known, check the signature here */
+        lval *a = lval_copy(x);
+        lval_del(lval_pop(a, 0));
+        lval *r = lbuiltin_check(f->builtin, a->cell, a->count, a->context);
+        if (r) {
+            lval_del(a);
+        } else {
+            r = lbuiltin_run(e, f->builtin, a);
+        }
+        if (opt_is_literal(r)) {
+            lval_del(x);
+            return r;
+        }
+        /* Errors are left to be raised when the code actually runs */
+        lval_del(r);
+    }
+
+    /* Trivial wrappers from the standard library */
+    if (args == 1) {
+        if (opt_is_library(f, "fst")) { return opt_inline_nth(x, 0); }
+        if (opt_is_library(f, "snd")) { return opt_inline_nth(x, 1); }
+        if (opt_is_library(f, "trd")) { return opt_inline_nth(x, 2); }
+    }
+    if (args == 3 && opt_is_library(f, "flip") &&
+        opt_is_simple(x->cell[2]) && opt_is_simple(x->cell[3])) {
+        /* (flip f a b) -> (f b a) */
+        lval_del(lval_pop(x, 0));
+        lval *a = lval_pop(x, 1);
+        return lval_add(x, a);
+    }
+
+    return x;
+}
+
+lval *opt_expr(lenv *e, lval *x, lval *formals) {
+    if (x->type != LVAL_SEXPR) { return x; }
+    return opt_call(e, x, formals);
+}
+
+lval *lval_optimize(lenv *e, lval *formals, lval *body) {
+    if (!lenv_state(e)->optimize) { return body; }
+    return opt_body(e, body, formals);
+}
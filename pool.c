@@ -0,0 +1,241 @@
+#include <pthread.h>
+#include "profile.c"
+
+/*
+ * Work-stealing thread pool behind the parallel builtins. A job runs over
+ * a range of indices split into chunks, queued on the deque of the thread
+ * submitting it. Threads take their own newest chunk first and steal the
+ * oldest chunk of another deque once theirs is empty. A thread waiting on
+ * its job keeps running chunks, so jobs can nest without deadlocking.
+ *
+ * Chunks run with lval_parallel at 2: globals must not change and inline
+ * caches are only read. Values are not tied to a thread, the buffers,
+ * contexts and caches they share are reference counted atomically.
+ */
+
+typedef struct ljob {
+    void (*run)(struct ljob *job, int begin, int end);
+    void *data;
+
+    /* Calls of the submitting thread, the stack chunks run under */
+    lprof_frame *frame;
+
+    /* Chunks not yet finished */
+    atomic_int pending;
+} ljob;
+
+typedef struct lchunk {
+    ljob *job;
+    int begin;
+    int end;
+} lchunk;
+
+/* Chunks of one thread, oldest at head */
+typedef struct ldeque {
+    pthread_mutex_t lock;
+    lchunk *chunks;
+    int head;
+    int tail;
+    int size;
+} ldeque;
+
+typedef struct lpool {
+    /* Threads to use including the submitting one, 0 until configured */
+    int threads;
+
+    /* Workers running, their deques and one shared by all other threads */
+    int started;
+    pthread_t *workers;
+    ldeque *deques;
+
+    /* Idle threads wait for chunks or for their job to finish */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    atomic_int queued;
+    int stopping;
+    int at_fork;
+} lpool;
+
+lpool lval_pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+
+/* Index of the deque of the current thread, -1 outside of the workers */
+_Thread_local int lpool_self = -1;
+
+void lstack_free(void);
+
+void ldeque_push(ldeque *d, lchunk c) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->size) {
+        /* Reuse the space before head before growing */
+        if (d->head > 0) {
+            memmove(d->chunks, d->chunks + d->head, sizeof(lchunk) * (size_t) (d->tail - d->head));
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            d->size = d->size ? d->size * 2 : 64;
+            d->chunks = realloc(d->chunks, sizeof(lchunk) * (size_t) d->size);
+        }
+    }
+    d->chunks[d->tail++] = c;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* Take the newest chunk, or the oldest when stealing */
+int ldeque_take(ldeque *d, lchunk *c, int steal) {
+    pthread_mutex_lock(&d->lock);
+    int found = d->head < d->tail;
+    if (found) {
+        *c = steal ? d->chunks[d->head++] : d->chunks[--d->tail];
+        if (d->head == d->tail) { d->head = d->tail = 0; }
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+/* Run one chunk from the own deque or a stolen one, 0 if there was none */
+int lpool_run_one(int self) {
+    lpool *p = &lval_pool;
+    int count = p->started + 1;
+    lchunk c;
+    int found = ldeque_take(&p->deques[self], &c, 0);
+    for (int i = 1; !found && i < count; i++) {
+        found = ldeque_take(&p->deques[(self + i) % count], &c, 1);
+    }
+    if (!found) { return 0; }
+
+    atomic_fetch_sub(&p->queued, 1);
+    lprof_frame *top = lprof_top;
+    lprof_top = c.job->frame;
+    c.job->run(c.job, c.begin, c.end);
+    lprof_top = top;
+    if (atomic_fetch_sub(&c.job->pending, 1) == 1) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->wake);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return 1;
+}
+
+void *lpool_worker(void *arg) {
+    lpool *p = &lval_pool;
+    lpool_self = (int) (long) arg;
+    lval_parallel = 2;
+
+    while (1) {
+        if (lpool_run_one(lpool_self)) { continue; }
+
+        pthread_mutex_lock(&p->lock);
+        while (!p->stopping && atomic_load(&p->queued) == 0) {
+            pthread_cond_wait(&p->wake, &p->lock);
+        }
+        int stopping = p->stopping;
+        pthread_mutex_unlock(&p->lock);
+        if (stopping) { break; }
+    }
+    lstack_free();
+    return NULL;
+}
+
+/* LISP_THREADS, or one thread per core */
+int lpool_default_threads(void) {
+    const char *env = getenv("LISP_THREADS");
+    int n = env ? atoi(env) : 0;
+    if (n <= 0) { n = (int) sysconf(_SC_NPROCESSORS_ONLN); }
+    return n > 0 ? n : 1;
+}
+
+/* Only the forking thread lives on in a child, its workers start again on use */
+void lpool_after_fork(void) {
+    lpool *p = &lval_pool;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    atomic_store(&p->queued, 0);
+    p->deques = NULL;
+    p->workers = NULL;
+    p->started = 0;
+}
+
+/* Start the workers if they are not running, called with the pool locked */
+void lpool_start(lpool *p) {
+    if (p->deques) { return; }
+    if (p->threads <= 0) { p->threads = lpool_default_threads(); }
+    if (!p->at_fork) {
+        pthread_atfork(NULL, NULL, lpool_after_fork);
+        p->at_fork = 1;
+    }
+
+    p->started = p->threads - 1;
+    p->deques = calloc((size_t) p->started + 1, sizeof(ldeque));
+    for (int i = 0; i <= p->started; i++) { pthread_mutex_init(&p->deques[i].lock, NULL); }
+    p->workers = calloc((size_t) p->started + 1, sizeof(pthread_t));
+    for (int i = 0; i < p->started; i++) {
+        pthread_create(&p->workers[i], NULL, lpool_worker, (void *) (long) i);
+    }
+}
+
+/* Stop the workers and use n threads from the next job, returns the old size */
+int lpool_resize(int n) {
+    lpool *p = &lval_pool;
+    pthread_mutex_lock(&p->lock);
+    int prev = p->threads > 0 ? p->threads : lpool_default_threads();
+    int started = p->deques != NULL;
+    p->stopping = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    if (started) {
+        for (int i = 0; i < p->started; i++) { pthread_join(p->workers[i], NULL); }
+        for (int i = 0; i <= p->started; i++) {
+            pthread_mutex_destroy(&p->deques[i].lock);
+            free(p->deques[i].chunks);
+        }
+        free(p->deques);
+        free(p->workers);
+        p->deques = NULL;
+        p->workers = NULL;
+        p->started = 0;
+    }
+    p->stopping = 0;
+    p->threads = n;
+    return prev;
+}
+
+/* Run job over [begin, end) in chunks of at most grain, returns when all are done */
+void lpool_run(ljob *job, int begin, int end, int grain) {
+    lpool *p = &lval_pool;
+    pthread_mutex_lock(&p->lock);
+    lpool_start(p);
+    pthread_mutex_unlock(&p->lock);
+    job->frame = lprof_top;
+
+    if (p->started == 0 || end - begin <= grain) {
+        if (begin < end) { job->run(job, begin, end); }
+        return;
+    }
+
+    int self = lpool_self >= 0 ? lpool_self : p->started;
+    int chunks = (end - begin + grain - 1) / grain;
+    atomic_store(&job->pending, chunks);
+    atomic_fetch_add(&p->queued, chunks);
+    for (int i = begin; i < end; i += grain) {
+        lchunk c = {job, i, i + grain < end ? i + grain : end};
+        ldeque_push(&p->deques[self], c);
+    }
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    /* Help with any chunk until this job is done */
+    int parallel = lval_parallel;
+    lval_parallel = 2;
+    while (atomic_load(&job->pending) > 0) {
+        if (lpool_run_one(self)) { continue; }
+
+        pthread_mutex_lock(&p->lock);
+        while (atomic_load(&job->pending) > 0 && atomic_load(&p->queued) == 0) {
+            pthread_cond_wait(&p->wake, &p->lock);
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    lval_parallel = parallel;
+}
@@ -0,0 +1,229 @@
+#include <signal.h>
+#include <sys/time.h>
+#include "cache.c"
+
+/*
+ * Sampling profiler. Each call of a function or builtin links a frame
+ * kept on the C stack, so the Lisp call stack of a thread is always known
+ * without allocating. While profiling, a SIGPROF timer interrupts the
+ * running thread and the handler counts the stack it finds in a table
+ * allocated when profiling starts, found by hash and confirmed frame by
+ * frame. The handler only uses atomics.
+ *
+ * Stacks are written root first, frames separated by ';' and followed by
+ * their count, the folded format read by flame graph tools. Lambdas show
+ * as name:row:col of their definition, builtins as their name.
+ */
+
+#define LPROF_HZ 997
+#define LPROF_DEPTH 64
+#define LPROF_SLOTS (1 << 14)
+#define LPROF_SITES (1 << 18)
+
+typedef struct lprof_frame {
+    const char *name;
+
+    /* Where a lambda was defined, NULL for builtins */
+    code_context *context;
+    struct lprof_frame *parent;
+} lprof_frame;
+
+/*
+ * Innermost call running on this thread. Initial-exec TLS is found at a
+ * fixed offset from the thread pointer, so the handler can read it even
+ * in liblisp loaded with dlopen, where other models may call into libc.
+ */
+__attribute__((tls_model("initial-exec"))) _Thread_local lprof_frame *lprof_top = NULL;
+
+/* Frames must be complete before the handler can see them */
+#define LPROF_PUSH(frame, fname, fcontext) \
+  lprof_frame frame = {fname, fcontext, lprof_top}; \
+  atomic_signal_fence(memory_order_seq_cst); \
+  lprof_top = &frame
+
+#define LPROF_POP(frame) \
+  lprof_top = frame.parent
+
+/* Frame as kept in a sample */
+typedef struct lprof_site {
+    const char *name;
+    int row;
+    int col;
+} lprof_site;
+
+/* Distinct stack and how often it was sampled, its sites leaf first */
+typedef struct lprof_slot {
+    atomic_ulong hash;
+    atomic_long count;
+    int first;
+    int depth;
+    atomic_int ready;
+} lprof_slot;
+
+typedef struct lprof {
+    int running;
+    lprof_slot *slots;
+    lprof_site *sites;
+    atomic_int sites_used;
+    atomic_long samples;
+    atomic_long dropped;
+} lprof;
+
+lprof lval_prof;
+
+/* Sites of a complete slot are those of the stack */
+int lprof_same(lprof *p, lprof_slot *s, lprof_site *stack, int depth) {
+    if (!atomic_load(&s->ready) || s->depth != depth) { return 0; }
+    for (int i = 0; i < depth; i++) {
+        lprof_site *site = &p->sites[s->first + i];
+        if (site->name != stack[i].name || site->row != stack[i].row || site->col != stack[i].col) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+unsigned long lprof_mix(unsigned long h, unsigned long x) {
+    h ^= x;
+    return h * 1099511628211UL;
+}
+
+/* Count the stack of the interrupted thread */
+void lprof_sample(int sig) {
+    lprof *p = &lval_prof;
+    int saved = errno;
+    lprof_site stack[LPROF_DEPTH + 1];
+    int depth = 0;
+    unsigned long h = 14695981039346656037UL;
+    lprof_frame *f = lprof_top;
+    for (; f && depth < LPROF_DEPTH; f = f->parent) {
+        lprof_site s = {f->name, 0, 0};
+        if (f->context) {
+            s.row = f->context->row;
+            s.col = f->context->col;
+        }
+        stack[depth++] = s;
+        h = lprof_mix(h, (unsigned long) s.name);
+        h = lprof_mix(h, (unsigned long) s.row << 32 | (unsigned int) s.col);
+    }
+
+    /* Deeper stacks keep their innermost calls under a common root */
+    if (f) {
+        lprof_site s = {"[truncated]", 0, 0};
+        stack[depth++] = s;
+        h = lprof_mix(h, 1);
+    }
+    if (h == 0) { h = 1; }
+    atomic_fetch_add(&p->samples, 1);
+
+    unsigned long i = h & (LPROF_SLOTS - 1);
+    for (int probe = 0; probe < LPROF_SLOTS; probe++, i = (i + 1) & (LPROF_SLOTS - 1)) {
+        lprof_slot *s = &p->slots[i];
+        unsigned long cur = atomic_load(&s->hash);
+        if (cur == 0) {
+            int first = atomic_fetch_add(&p->sites_used, depth);
+            if (first + depth > LPROF_SITES) { break; }
+            if (atomic_compare_exchange_strong(&s->hash, &cur, h)) {
+                for (int j = 0; j < depth; j++) { p->sites[first + j] = stack[j]; }
+                s->first = first;
+                s->depth = depth;
+                atomic_fetch_add(&s->count, 1);
+                atomic_store(&s->ready, 1);
+                errno = saved;
+                return;
+            }
+        }
+        /* Equal hashes of other stacks probe on, so may one still being written */
+        if (cur == h && lprof_same(p, s, stack, depth)) {
+            atomic_fetch_add(&s->count, 1);
+            errno = saved;
+            return;
+        }
+    }
+
+    /* The table is full */
+    atomic_fetch_add(&p->dropped, 1);
+    errno = saved;
+}
+
+/* Sample hz times a second of CPU time, 0 if already profiling */
+int lprof_start(int hz) {
+    lprof *p = &lval_prof;
+    if (p->running) { return 0; }
+    p->running = 1;
+
+    /* Kept once allocated, a late signal on another thread may still use them */
+    if (p->slots == NULL) {
+        p->slots = malloc(sizeof(lprof_slot) * LPROF_SLOTS);
+        p->sites = malloc(sizeof(lprof_site) * LPROF_SITES);
+    }
+    memset(p->slots, 0, sizeof(lprof_slot) * LPROF_SLOTS);
+    atomic_init(&p->sites_used, 0);
+    atomic_init(&p->samples, 0);
+    atomic_init(&p->dropped, 0);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lprof_sample;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    struct itimerval t;
+    t.it_interval.tv_sec = 0;
+    t.it_interval.tv_usec = 1000000 / hz;
+    t.it_value = t.it_interval;
+    setitimer(ITIMER_PROF, &t, NULL);
+    return 1;
+}
+
+void lprof_write_site(FILE *out, lprof_site *s) {
+    if (s->row) {
+        fprintf(out, "%s:%i:%i", s->name, s->row, s->col);
+    } else {
+        fputs(s->name, out);
+    }
+}
+
+/*
+ * Stop sampling and write the folded stacks to file, returning the
+ * number of samples, or -1 if not profiling or the file failed.
+ */
+long lprof_stop(const char *file) {
+    lprof *p = &lval_prof;
+    if (!p->running) { return -1; }
+
+    struct itimerval t;
+    memset(&t, 0, sizeof(t));
+    setitimer(ITIMER_PROF, &t, NULL);
+    signal(SIGPROF, SIG_IGN);
+    p->running = 0;
+
+    FILE *out = fopen(file, "w");
+    for (int i = 0; out && i < LPROF_SLOTS; i++) {
+        lprof_slot *s = &p->slots[i];
+        if (!atomic_load(&s->ready)) { continue; }
+        if (s->depth == 0) { fputs("[lisp]", out); }
+        for (int j = s->depth - 1; j >= 0; j--) {
+            lprof_write_site(out, &p->sites[s->first + j]);
+            if (j) { fputc(';', out); }
+        }
+        fprintf(out, " %ld\n", atomic_load(&s->count));
+    }
+    if (out && atomic_load(&p->dropped)) {
+        fprintf(out, "[dropped] %ld\n", atomic_load(&p->dropped));
+    }
+    long samples = atomic_load(&p->samples);
+    if (out == NULL || fclose(out) != 0) { samples = -1; }
+    return samples;
+}
+
+/* File --profile writes to when the program exits */
+const char *lprof_file = NULL;
+
+void lprof_at_exit(void) {
+    if (!lval_prof.running) { return; }
+    if (lprof_stop(lprof_file) < 0) {
+        fprintf(stderr, "Could not write profile '%s': %s\n", lprof_file, strerror(errno));
+    }
+}
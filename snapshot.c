@@ -0,0 +1,497 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "optimize.c"
+
+/*
+ * Binary files of values: images of the global environment and cached
+ * forms of loaded files. Images are written after the standard library
+ * and any prelude are loaded, a later start maps one into memory and
+ * decodes it instead of reading, parsing and evaluating the library.
+ *
+ * Layout: header, values, then the table of code contexts the values
+ * refer to. Numbers are stored in native byte order, so a file is only
+ * read by the build that wrote it. Builtins are stored by name.
+ */
+
+#define SNAPSHOT_MAGIC "LISPIMG"
+#define SNAPSHOT_VERSION 4
+
+enum { SNAP_BUILTIN, SNAP_LAMBDA, SNAP_MEMO, SNAP_PARTIAL };
+
+extern const lbuiltin_def lisp_builtins[];
+
+/* Start of every file, followed by a header of its own kind */
+typedef struct snap_header {
+    char magic[8];
+    unsigned int version;
+    unsigned int contexts;
+    unsigned int contexts_offset;
+} snap_header;
+
+typedef struct snap_image_header {
+    snap_header h;
+    unsigned int bindings;
+} snap_image_header;
+
+typedef struct snap_buf {
+    char *data;
+    size_t len;
+    size_t size;
+} snap_buf;
+
+typedef struct snap_writer {
+    snap_buf values;
+    snap_buf contexts;
+
+    /* Contexts already written, open addressing by pointer */
+    code_context **seen;
+    unsigned int *seen_index;
+    unsigned int seen_size;
+    unsigned int count;
+} snap_writer;
+
+void snap_put(snap_buf *b, const void *p, size_t n) {
+    if (b->len + n > b->size) {
+        while (b->len + n > b->size) { b->size = b->size ? b->size * 2 : 4096; }
+        b->data = realloc(b->data, b->size);
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+void snap_u32(snap_buf *b, unsigned int x) { snap_put(b, &x, sizeof(x)); }
+
+void snap_u8(snap_buf *b, unsigned char x) { snap_put(b, &x, sizeof(x)); }
+
+void snap_text(snap_buf *b, const char *s, size_t len) {
+    snap_u32(b, (unsigned int) len);
+    snap_put(b, s, len);
+}
+
+void snap_grow_seen(snap_writer *w);
+
+/* Index of a context in the table, 0 for none */
+unsigned int snap_context(snap_writer *w, code_context *c) {
+    if (c == NULL) { return 0; }
+    if (w->count * 2 >= w->seen_size) { snap_grow_seen(w); }
+
+    unsigned int mask = w->seen_size - 1;
+    unsigned int slot = (unsigned int) (((unsigned long) c >> 4) & mask);
+    while (w->seen[slot]) {
+        if (w->seen[slot] == c) { return w->seen_index[slot]; }
+        slot = (slot + 1) & mask;
+    }
+
+    size_t len = 0;
+    while (len < CONTEXT_TRACE && c->trace[len]) { len++; }
+    snap_u32(&w->contexts, (unsigned int) c->row);
+    snap_u32(&w->contexts, (unsigned int) c->col);
+    snap_text(&w->contexts, c->trace, len);
+
+    w->seen[slot] = c;
+    w->seen_index[slot] = ++w->count;
+    return w->count;
+}
+
+void snap_grow_seen(snap_writer *w) {
+    code_context **seen = w->seen;
+    unsigned int *index = w->seen_index;
+    unsigned int size = w->seen_size;
+
+    w->seen_size = size ? size * 2 : 1024;
+    w->seen = calloc(w->seen_size, sizeof(code_context *));
+    w->seen_index = calloc(w->seen_size, sizeof(unsigned int));
+    for (unsigned int i = 0; i < size; i++) {
+        if (!seen[i]) { continue; }
+        unsigned int slot = (unsigned int) (((unsigned long) seen[i] >> 4) & (w->seen_size - 1));
+        while (w->seen[slot]) { slot = (slot + 1) & (w->seen_size - 1); }
+        w->seen[slot] = seen[i];
+        w->seen_index[slot] = index[i];
+    }
+    free(seen);
+    free(index);
+}
+
+void snap_write(snap_writer *w, lval *v) {
+    snap_buf *b = &w->values;
+    snap_u8(b, (unsigned char) v->type);
+    snap_u32(b, snap_context(w, v->context));
+
+    switch (v->type) {
+        case LVAL_NUM:
+            snap_put(b, &v->num, sizeof(v->num));
+            break;
+        case LVAL_ERR:
+            snap_text(b, lval_err_msg(v), v->len);
+            break;
+        case LVAL_SYM:
+            snap_text(b, v->sym, v->len);
+            break;
+        case LVAL_STR:
+            snap_text(b, v->str, v->len);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            snap_u8(b, (unsigned char) v->optimized);
+            snap_u32(b, (unsigned int) v->count);
+            for (int i = 0; i < v->count; i++) { snap_write(w, v->cell[i]); }
+            break;
+        case LVAL_FUN:
+            if (v->builtin) {
+                snap_u8(b, SNAP_BUILTIN);
+                snap_text(b, v->builtin->name, strlen(v->builtin->name));
+            } else if (v->memo) {
+                snap_u8(b, SNAP_MEMO);
+                snap_put(b, &v->memo->capacity, sizeof(v->memo->capacity));
+                snap_write(w, v->memo->fn);
+            } else if (v->partial) {
+                snap_u8(b, SNAP_PARTIAL);
+                snap_u32(b, (unsigned int) v->partial->remaining);
+                snap_write(w, v->partial->fn);
+                snap_write(w, v->partial->args);
+            } else {
+                snap_u8(b, SNAP_LAMBDA);
+                snap_write(w, v->lambda->formals);
+                snap_write(w, v->lambda->body);
+                snap_text(b, v->name ? v->name->name : "", v->name ? v->name->len : 0);
+                snap_u8(b, (unsigned char) v->library);
+            }
+            break;
+        case LVAL_SEQ: {
+            /* The recipe, items are produced again when read */
+            lseq *s = v->seq;
+            lval *parts[3] = {s->fn, s->value, s->source};
+            snap_u8(b, (unsigned char) s->kind);
+            snap_put(b, &s->from, sizeof(s->from));
+            snap_put(b, &s->to, sizeof(s->to));
+            snap_put(b, &s->step, sizeof(s->step));
+            snap_put(b, &s->n, sizeof(s->n));
+            for (int i = 0; i < 3; i++) {
+                snap_u8(b, parts[i] != NULL);
+                if (parts[i]) { snap_write(w, parts[i]); }
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void snap_writer_free(snap_writer *w) {
+    free(w->values.data);
+    free(w->contexts.data);
+    free(w->seen);
+    free(w->seen_index);
+}
+
+/* Temporary files of threads writing the same file must differ */
+atomic_int snap_tmp_count = 0;
+
+/*
+ * Write a header of head_size bytes starting with h, then the values
+ * and contexts of w. The file is written next to its final name and
+ * renamed into place, so readers never see a partial file.
+ */
+int snap_write_file(const char *file, snap_header *h, size_t head_size, snap_writer *w) {
+    h->contexts = w->count;
+    h->contexts_offset = (unsigned int) (head_size + w->values.len);
+
+    size_t len = strlen(file);
+    char *tmp = malloc(len + 32);
+    snprintf(tmp, len + 32, "%s.%ld.%d.tmp", file, (long) getpid(), atomic_fetch_add(&snap_tmp_count, 1));
+
+    FILE *out = fopen(tmp, "wb");
+    int ok = out != NULL &&
+             fwrite(h, head_size, 1, out) == 1 &&
+             fwrite(w->values.data, 1, w->values.len, out) == w->values.len &&
+             fwrite(w->contexts.data, 1, w->contexts.len, out) == w->contexts.len;
+    if (out && fclose(out) != 0) { ok = 0; }
+    if (ok) { ok = rename(tmp, file) == 0; }
+    if (!ok) { remove(tmp); }
+
+    free(tmp);
+    return ok;
+}
+
+lval *snapshot_save(lenv *e, char *file) {
+    snap_writer w;
+    memset(&w, 0, sizeof(w));
+
+    for (int i = 0; i < e->count; i++) {
+        snap_text(&w.values, e->syms[i]->name, e->syms[i]->len);
+        snap_write(&w, e->vals[i]);
+    }
+
+    snap_image_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    h.h.version = SNAPSHOT_VERSION;
+    h.bindings = (unsigned int) e->count;
+
+    int ok = snap_write_file(file, &h.h, sizeof(h), &w);
+    snap_writer_free(&w);
+
+    if (!ok) { return lval_err(NULL, "Could not write image '%s'", file); }
+    return lval_sexpr(NULL);
+}
+
+typedef struct snap_reader {
+    const char *p;
+    const char *end;
+    int ok;
+    code_context **contexts;
+    unsigned int context_count;
+} snap_reader;
+
+void snap_get(snap_reader *r, void *out, size_t n) {
+    if (!r->ok || (size_t) (r->end - r->p) < n) {
+        r->ok = 0;
+        memset(out, 0, n);
+        return;
+    }
+    memcpy(out, r->p, n);
+    r->p += n;
+}
+
+unsigned int snap_get_u32(snap_reader *r) {
+    unsigned int x;
+    snap_get(r, &x, sizeof(x));
+    return x;
+}
+
+unsigned char snap_get_u8(snap_reader *r) {
+    unsigned char x;
+    snap_get(r, &x, sizeof(x));
+    return x;
+}
+
+/* Text stays in the mapped image, the caller copies it */
+const char *snap_get_text(snap_reader *r, size_t *len) {
+    *len = snap_get_u32(r);
+    if (!r->ok || (size_t) (r->end - r->p) < *len) {
+        r->ok = 0;
+        *len = 0;
+        return "";
+    }
+    const char *s = r->p;
+    r->p += *len;
+    return s;
+}
+
+lval *snap_read(snap_reader *r, int depth) {
+    int type = snap_get_u8(r);
+    unsigned int ci = snap_get_u32(r);
+    if (!r->ok || ci > r->context_count || depth > 10000) {
+        r->ok = 0;
+        return lval_sexpr(NULL);
+    }
+    code_context *c = ci ? r->contexts[ci - 1] : NULL;
+
+    size_t len;
+    const char *text;
+    lval *v;
+    switch (type) {
+        case LVAL_NUM: {
+            long x;
+            snap_get(r, &x, sizeof(x));
+            return lval_num(x, c);
+        }
+        case LVAL_ERR:
+            text = snap_get_text(r, &len);
+            v = lval_err_code(c, LERR_MESSAGE, NULL, 0, 0, 0);
+            v->err = lval_set_text(v, text, len);
+            return v;
+        case LVAL_STR:
+        case LVAL_SYM:
+            /* Same as a literal read from source */
+            text = snap_get_text(r, &len);
+            v = calloc(1, sizeof(lval));
+            v->type = type;
+            v->str = lval_intern_text(v, text, len);
+            if (type == LVAL_SYM) {
+                v->sym = v->str;
+                v->str = NULL;
+                v->id = lsym_intern(v->sym, v->len);
+                v->cache = calloc(1, sizeof(lcache));
+                v->cache->refs = 1;
+            }
+            v->context = copy_context(c);
+            return v;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR: {
+            int optimized = snap_get_u8(r);
+            unsigned int count = snap_get_u32(r);
+            if (!r->ok || count > (size_t) (r->end - r->p)) {
+                r->ok = 0;
+                return lval_sexpr(NULL);
+            }
+            v = type == LVAL_SEXPR ? lval_sexpr(c) : lval_qexpr(c);
+            v->cell = calloc(count ? count : 1, sizeof(lval *));
+            for (unsigned int i = 0; i < count; i++) {
+                v->cell[v->count++] = snap_read(r, depth + 1);
+            }
+            v->optimized = optimized;
+
+            /* Hashed like the quoted literals of lval_read */
+            if (v->type == LVAL_QEXPR) { lval_content_hash(v); }
+            v->jump = lcase_new(v);
+            return v;
+        }
+        case LVAL_FUN:
+            switch (snap_get_u8(r)) {
+                case SNAP_BUILTIN:
+                    text = snap_get_text(r, &len);
+                    for (const lbuiltin_def *d = lisp_builtins; d->name; d++) {
+                        if (strlen(d->name) == len && memcmp(d->name, text, len) == 0) {
+                            return lval_func(d);
+                        }
+                    }
+                    break;
+                case SNAP_LAMBDA: {
+                    lval *formals = snap_read(r, depth + 1);
+                    lval *body = snap_read(r, depth + 1);
+                    v = lval_lambda(formals, body, c);
+                    text = snap_get_text(r, &len);
+                    if (len) { v->name = lsym_intern(text, len); }
+                    v->library = snap_get_u8(r);
+                    return v;
+                }
+                case SNAP_MEMO: {
+                    long capacity;
+                    snap_get(r, &capacity, sizeof(capacity));
+                    v = lval_func(NULL);
+                    v->memo = lmemo_new(snap_read(r, depth + 1), capacity);
+                    v->context = copy_context(c);
+                    return v;
+                }
+                case SNAP_PARTIAL: {
+                    int remaining = (int) snap_get_u32(r);
+                    lval *fn = snap_read(r, depth + 1);
+                    lval *args = snap_read(r, depth + 1);
+                    v = lval_partial(fn, args, remaining);
+                    lval_del(fn);
+                    return v;
+                }
+                default:
+                    break;
+            }
+            break;
+        case LVAL_SEQ: {
+            v = lval_seq(snap_get_u8(r), c);
+            lseq *s = v->seq;
+            snap_get(r, &s->from, sizeof(s->from));
+            snap_get(r, &s->to, sizeof(s->to));
+            snap_get(r, &s->step, sizeof(s->step));
+            snap_get(r, &s->n, sizeof(s->n));
+            lval **parts[3] = {&s->fn, &s->value, &s->source};
+            for (int i = 0; i < 3 && r->ok; i++) {
+                if (snap_get_u8(r)) { *parts[i] = snap_read(r, depth + 1); }
+            }
+            if (r->ok && s->kind >= LSEQ_RANGE && s->kind <= LSEQ_LINES) { return v; }
+            lval_del(v);
+            break;
+        }
+        default:
+            break;
+    }
+
+    r->ok = 0;
+    return lval_sexpr(NULL);
+}
+
+/* Map a whole file read only, NULL if it cannot be read */
+char *snap_map(const char *file, size_t *size) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) { return NULL; }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    *size = (size_t) st.st_size;
+    char *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return data == MAP_FAILED ? NULL : data;
+}
+
+/*
+ * Check the header of a mapped file, decode its contexts and position
+ * the reader on the values after a header of head_size bytes.
+ */
+int snap_reader_open(snap_reader *r, const char *data, size_t size,
+                     const char *magic, unsigned int version, size_t head_size) {
+    snap_header h;
+    r->ok = 0;
+    r->contexts = NULL;
+    r->context_count = 0;
+    if (size < head_size) { return 0; }
+
+    memcpy(&h, data, sizeof(h));
+    if (memcmp(h.magic, magic, strlen(magic) + 1) != 0 || h.version != version ||
+        h.contexts_offset < head_size || h.contexts_offset > size) {
+        return 0;
+    }
+
+    /* Contexts first, values refer to them by index */
+    r->ok = 1;
+    r->p = data + h.contexts_offset;
+    r->end = data + size;
+    r->contexts = calloc(h.contexts ? h.contexts : 1, sizeof(code_context *));
+    for (unsigned int i = 0; i < h.contexts && r->ok; i++) {
+        int row = (int) snap_get_u32(r);
+        int col = (int) snap_get_u32(r);
+        size_t len;
+        const char *trace = snap_get_text(r, &len);
+        char *copy = str_dup_n(trace, len);
+        r->contexts[r->context_count++] = create_context(row, col, copy);
+        free(copy);
+    }
+
+    r->p = data + head_size;
+    r->end = data + h.contexts_offset;
+    return r->ok;
+}
+
+void snap_reader_close(snap_reader *r) {
+    /* Values hold their own references */
+    for (unsigned int i = 0; i < r->context_count; i++) { free_context(r->contexts[i]); }
+    free(r->contexts);
+}
+
+/* Bind everything in an image into e, which should be a fresh environment */
+lval *snapshot_load(lenv *e, char *file) {
+    size_t size;
+    char *data = snap_map(file, &size);
+    if (data == NULL) { return lval_err(NULL, "Could not load image '%s'", file); }
+
+    snap_reader r;
+    snap_image_header h;
+    if (snap_reader_open(&r, data, size, SNAPSHOT_MAGIC, SNAPSHOT_VERSION, sizeof(h))) {
+        memcpy(&h, data, sizeof(h));
+    }
+
+    for (unsigned int i = 0; r.ok && i < h.bindings; i++) {
+        size_t len;
+        const char *name = snap_get_text(&r, &len);
+        lval *k = calloc(1, sizeof(lval));
+        k->type = LVAL_SYM;
+        k->sym = lval_set_text(k, name, len);
+        k->id = lsym_intern(k->sym, k->len);
+        lval *v = snap_read(&r, 0);
+        if (r.ok) {
+            lenv_set(e, k, v);
+        } else {
+            lval_del(v);
+        }
+        lval_del(k);
+    }
+
+    snap_reader_close(&r);
+    munmap(data, size);
+
+    if (!r.ok) { return lval_err(NULL, "Could not load image '%s': Invalid image", file); }
+    return lval_sexpr(NULL);
+}
@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <string.h>
+#include "lisp.h"
+
+/*
+ * The embedding API as a host uses it. Only the API is exported, so a
+ * host may define functions with the same names as interpreter internals.
+ */
+
+int failed = 0;
+
+void check(const char *name, int ok) {
+    printf("%s %s\n", ok ? "ok" : "FAIL", name);
+    if (!ok) { failed = 1; }
+}
+
+/* Names the interpreter also uses internally */
+int parse(void) { return 1; }
+int exists(void) { return 2; }
+char *load_file(void) { return "host"; }
+
+lisp_value *twice(lisp_interp *l, lisp_value **argv, int argc, void *data) {
+    return lisp_make_number(2 * lisp_number(argv[0]));
+}
+
+/* Number a source evaluates to, -1 on any other result */
+long eval_number(lisp_interp *l, const char *source) {
+    lisp_value *v = lisp_eval_string(l, source);
+    long n = lisp_type(v) == LISP_NUMBER ? lisp_number(v) : -1;
+    if (lisp_type(v) == LISP_ERROR) { printf("%s\n", lisp_string(v, NULL)); }
+    lisp_value_free(v);
+    return n;
+}
+
+int main(void) {
+    check("host functions keep their names", parse() == 1 && exists() == 2 &&
+                                             strcmp(load_file(), "host") == 0);
+
+    lisp_interp *l = lisp_new();
+    check("builtins without the library", eval_number(l, "(+ 1 2)") == 3);
+
+    lisp_value *v = lisp_load_stdlib(l, NULL);
+    check("library loaded", lisp_type(v) != LISP_ERROR);
+    lisp_value_free(v);
+    check("library function", eval_number(l, "(fst {7 8})") == 7);
+    check("library function in a lambda", eval_number(l, "(fun {f l} {+ (snd l) (len l)}) (f {1 2 3})") == 5);
+
+    lisp_define(l, "twice", twice, 1, 1, NULL);
+    check("host function", eval_number(l, "(twice (nth 1 {10 21}))") == 42);
+    lisp_free(l);
+    return failed;
+}
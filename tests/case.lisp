@@ -0,0 +1,24 @@
+(load "tests/check.lisp")
+
+(fun {name x} {case x {1 "one"} {2 "two"} {"three" 3} {{4} "four"}})
+(check "number key" (== (name 2) "two"))
+(check "string key" (== (name "three") 3))
+(check "list key" (== (name {4}) "four"))
+(check "no case" (== (try {name 5} {"none"}) "none"))
+
+; Another call with different keys gets its own table
+(fun {other x} {case x {1 "uno"} {2 "dos"}})
+(check "separate tables" (== (join (list (other 1)) (list (name 1))) {"uno" "one"}))
+
+; The first clause with a key wins
+(check "first duplicate wins" (== (case 1 {1 "first"} {1 "second"}) "first"))
+
+; Workers build tables of their own
+(check "in parallel" (== (pmap name {1 2 "three"}) {"one" "two" 3}))
+
+; Clauses that are not literals are looked at on every call
+(fun {pick x c} {case x c {2 "two"}})
+(check "clause from an argument" (== (pick 1 {1 "one"}) "one"))
+(check "same call, other clause" (== (pick 1 {1 "uno"}) "uno"))
+(check "computed key" (== (case 2 {(+ 1 1) "two"} {2 "dos"}) "two"))
+(check "built call" (== (eval (join (list case 2) {{1 "one"} {2 "two"}})) "two"))
@@ -0,0 +1,4 @@
+; Checks used by the test scripts, a failed one prints FAIL and its name
+(fun {check name ok} {
+  if ok {print "ok" name} {print "FAIL" name}
+})
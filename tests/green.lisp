@@ -0,0 +1,22 @@
+(load "tests/check.lisp")
+
+(fun {down n} {if (== n 0) {0} {+ 1 (down (- n 1))}})
+
+; Recursion a thousand calls deep inside a task
+(fun {count-task c n} {send c (len (realize (range 0 n)))})
+(def {c} (chan 1))
+(spawn count-task c 1000)
+(check "deep len in task" (== (recv c) 1000))
+
+(fun {down-task c n} {send c (down n)})
+(spawn down-task c 3000)
+(check "deep recursion in task" (== (recv c) 3000))
+
+; Recursion past the limit fails with an error instead of crashing
+(fun {endless-task c n} {send c (catch {down n} (lambda {m} {m}))})
+(spawn endless-task c 100000)
+(check "depth exceeded" (starts-with (recv c) "Stack depth exceeded"))
+
+; The task's stack is reused afterwards
+(spawn down-task c 2000)
+(check "task after overflow" (== (recv c) 2000))
@@ -0,0 +1,4 @@
+; Run from an image, tasks spawned by the script still run before exit
+(fun {task x} {print "task ran" x})
+(spawn task 1)
+(print "main done")
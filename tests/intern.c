@@ -0,0 +1,71 @@
+#include "batch.c"
+
+/*
+ * Long literals are shared through the hash-consing table only while
+ * something holds them. A batch server answering many requests with
+ * distinct literals must not grow the table.
+ */
+
+int failed = 0;
+
+void check(const char *name, int ok) {
+    printf("%s %s\n", ok ? "ok" : "FAIL", name);
+    if (!ok) { failed = 1; }
+}
+
+long interned_count(void) {
+    long n = 0;
+    for (int i = 0; i < LSTR_INTERN_BUCKETS; i++) {
+        for (lstr_intern *it = lstr_interned[i]; it; it = it->next) { n++; }
+    }
+    return n;
+}
+
+/* String as the reader makes it for a literal */
+lval *literal(const char *s) {
+    lval *v = calloc(1, sizeof(lval));
+    v->type = LVAL_STR;
+    v->str = lval_intern_text(v, s, strlen(s));
+    return v;
+}
+
+/* Answer count requests, each with its own long literal */
+void serve_literals(lenv *e, int from, int count) {
+    char file[] = "/tmp/lisp-intern-XXXXXX";
+    FILE *in = fdopen(mkstemp(file), "w+");
+    for (int i = from; i < from + count; i++) {
+        fprintf(in, "(str-len \"a literal long enough to be interned %i\")\n", i);
+    }
+    fflush(in);
+    rewind(in);
+
+    int out = open("/dev/null", O_WRONLY);
+    batch_serve(e, fileno(in), out, NULL);
+    close(out);
+    fclose(in);
+    unlink(file);
+}
+
+int main(void) {
+    lenv *e = lenv_new();
+    lenv_add_builtins(e);
+
+    /* Literals alive at the same time still share a buffer */
+    lval *a = literal("a literal long enough to be interned");
+    lval *b = literal("a literal long enough to be interned");
+    lval_del(a);
+    a = literal("a literal long enough to be interned");
+    check("equal literals share", a->buf == b->buf);
+    lval_del(a);
+    lval_del(b);
+
+    long before = interned_count();
+    serve_literals(e, 0, 1000);
+    long after = interned_count();
+    serve_literals(e, 1000, 5000);
+    check("literals of answered requests are dropped", after == before);
+    check("table stays flat", interned_count() == after);
+
+    lenv_del(e);
+    return failed;
+}
@@ -0,0 +1,25 @@
+(load "tests/check.lisp")
+
+; Loop variables stay inside their loop
+(def {total} 0)
+(dotimes {i 4} {= {total} (+ total i)})
+(check "dotimes sums" (== total 6))
+(check "dotimes variable does not leak" (== (try {i} {"unbound"}) "unbound"))
+
+(= {words} "")
+(for-each {w {"a" "b" "c"}} {= {words} (concat words w)})
+(check "for-each joins" (== words "abc"))
+(check "for-each variable does not leak" (== (try {w} {"unbound"}) "unbound"))
+
+; = reaches the bindings of the enclosing function
+(fun {sum-list l} {do (= {s} 0) (for-each {x l} {= {s} (+ s x)}) s})
+(check "accumulates in a function" (== (sum-list {1 2 3 4}) 10))
+(fun {count-up n} {do (= {c} 0) (dotimes {k n} {dotimes {j n} {= {c} (+ c 1)}}) c})
+(check "nested loops" (== (count-up 3) 9))
+
+; Assigning the loop variable only lasts for its iteration
+(= {seen} {})
+(dotimes {i 3} {do (= {i} (* i 10)) (= {seen} (join seen (list i)))})
+(check "counter reassigned" (== seen {0 10 20}))
+(for-each {x {1 2}} {= {x} "gone"})
+(check "for-each variable reassigned" (== (try {x} {"unbound"}) "unbound"))
@@ -0,0 +1,23 @@
+(load "tests/check.lisp")
+
+; The standard library wrappers are still inlined
+(fun {second l} {snd l})
+(check "snd inlined" (== (second {1 2 3}) 2))
+
+; A redefined fst is called, not inlined
+(fun {fst l} {"mine"})
+(fun {g l} {fst l})
+(check "redefined fst" (== (g {1 2}) "mine"))
+
+; A redefined len is not folded, so it does not run at definition time
+(def {calls} 0)
+(fun {len l} {do (def {calls} (+ calls 1)) 42})
+(fun {h x} {len {1 2 3}})
+(check "len not run when defined" (== calls 0))
+(check "redefined len" (== (h 0) 42))
+(check "len run when called" (== calls 1))
+
+; Builtins are still folded under another name
+(def {plus} +)
+(fun {day x} {plus 60 60 24})
+(check "alias folded" (== (day 0) 144))
@@ -0,0 +1,90 @@
+#define _DEFAULT_SOURCE
+#include "builtins.c"
+
+/*
+ * Forms read back from the form cache and values started from an image
+ * must carry the structural hashes lval_read caches on forms parsed from
+ * source. Run with LISP_CACHE set to an empty directory.
+ */
+
+int failed = 0;
+
+void check(const char *name, int ok) {
+    printf("%s %s\n", ok ? "ok" : "FAIL", name);
+    if (!ok) { failed = 1; }
+}
+
+/* Every hash cached on the parsed value is also cached on the read one */
+int same_hashes(lval *parsed, lval *read) {
+    if (parsed->type != read->type || parsed->count != read->count) { return 0; }
+    if (parsed->hashed && (!read->hashed || parsed->hash != read->hash)) { return 0; }
+    for (int i = 0; i < parsed->count; i++) {
+        if (!same_hashes(parsed->cell[i], read->cell[i])) { return 0; }
+    }
+    if (parsed->type == LVAL_FUN && parsed->lambda) {
+        return read->lambda && same_hashes(parsed->lambda->formals, read->lambda->formals) &&
+               same_hashes(parsed->lambda->body, read->lambda->body);
+    }
+    return 1;
+}
+
+/* Globals of a saved environment against those of the image it started */
+int same_globals(lenv *saved, lenv *started) {
+    for (int i = 0; i < saved->count; i++) {
+        int found = 0;
+        for (int j = 0; j < started->count; j++) {
+            if (started->syms[j] != saved->syms[i]) { continue; }
+            if (!same_hashes(saved->vals[i], started->vals[j])) { return 0; }
+            found = 1;
+        }
+        if (!found) { return 0; }
+    }
+    return 1;
+}
+
+int main(void) {
+    char file[] = "/tmp/lisp-reader-XXXXXX";
+    int fd = mkstemp(file);
+    const char *source =
+            "(def {xs} {1 {2 3} \"a string long enough to be interned by the reader\"})\n"
+            "(fun {f x} {case x {1 {one}} {2 {two}}})\n";
+    if (fd < 0 || write(fd, source, strlen(source)) != (ssize_t) strlen(source)) {
+        perror(file);
+        return 1;
+    }
+    close(fd);
+
+    /* The first read parses and fills the cache, the second one uses it */
+    lval *parsed = lval_read_file(file, NULL);
+    lval *cached = lval_read_file(file, NULL);
+    form_cache_key key = {NULL, 0, 0, 0};
+    char *entry = form_cache_key_of(&key, file, source) ? form_cache_entry(&key) : NULL;
+    check("forms cached", entry && access(entry, R_OK) == 0);
+    check("quoted lists hashed when parsed", parsed->cell[0]->cell[2]->hashed);
+    check("cached forms keep their hashes", same_hashes(parsed, cached));
+
+    /* Values defined by the file, saved to an image and started again */
+    lenv *saved = lenv_new();
+    lenv_add_builtins(saved);
+    lval_del(lval_load_forms(saved, file, lval_copy(parsed), NULL));
+    char image[] = "/tmp/lisp-image-XXXXXX";
+    close(mkstemp(image));
+    lval_del(snapshot_save(saved, image));
+    lenv *started = lenv_new();
+    lenv_add_builtins(started);
+    lval *loaded = snapshot_load(started, image);
+    check("image loaded", loaded->type != LVAL_ERR);
+    check("image values keep their hashes", same_globals(saved, started));
+
+    lval_del(loaded);
+    lenv_del(saved);
+    lenv_del(started);
+    unlink(image);
+    lval_del(parsed);
+    lval_del(cached);
+    if (entry) { unlink(entry); }
+    free(entry);
+    free(key.path);
+    unlink(file);
+    return failed;
+}
@@ -15,7 +15,12 @@ enum {
     TOKENIZER_ERROR
 };
 
+/* Errors print at most this much of the source after a location */
+#define CONTEXT_TRACE 50
+
+/* Immutable source location, shared by reference between values */
 typedef struct code_context {
+    lrefs refs;
     int row;
     int col;
     char *trace;
@@ -88,15 +93,21 @@ int column(const char *curr_loc, const char *row_start) {
 
 code_context *create_context(int row, int col, const char *trace) {
     code_context *context = calloc(1, sizeof(code_context));
+    context->refs = 1;
     context->row = row;
     context->col = col;
-    context->trace = str_dup(trace);
+
+    /* Only keep what is printed, the trace otherwise runs to the end of the file */
+    size_t len = 0;
+    while (len < CONTEXT_TRACE && trace[len]) { len++; }
+    context->trace = str_dup_n(trace, len);
     return context;
 }
 
 code_context *copy_context(code_context *c) {
     if (!c) return c;
-    return create_context(c->row, c->col, c->trace);
+    lref_inc(&c->refs);
+    return c;
 }
 
 token *create_token(const char *start, const char *curr_loc, int type,
@@ -208,6 +219,7 @@ char *token_name(int type) {
 
 void free_context(code_context *c) {
     if (c == NULL) { return; }
+    if (lref_dec(&c->refs) > 0) { return; }
     free(c->trace);
     free(c);
 }